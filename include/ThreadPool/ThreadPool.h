@@ -19,6 +19,9 @@ public:
     decltype(auto) enqueue(F&& f, Args&&... args);
 
     ~ThreadPool();
+
+    // number of tasks waiting for a worker
+    size_t queue_size();
     
 private:
     std::vector<std::thread> workers;
@@ -79,6 +82,12 @@ inline ThreadPool::~ThreadPool()
         worker.join();
 }
 
+inline size_t ThreadPool::queue_size()
+{
+    std::lock_guard lock{ queue_mutex };
+    return tasks.size();
+}
+
 inline void ThreadPool::newWorker()
 {
     auto& flag = tasks_full_flag;
@@ -2,85 +2,356 @@
 
 #include "reaper_plugin_functions.h"
 #include "log.h"
+#include "metrics.h"
+#include "project_state.h"
+#include "accessor_pool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
 
 
 using std::pair; 
+using std::shared_ptr;
+
+// items closer than this (in seconds) are read as one segment,
+// one bigger read is cheaper than lots of tiny ones
+double ITEM_MERGE_GAP = 0.5;
+
+// how many samples (per channel) we ask the accessor for at once
+int ACCESSOR_WINDOW = 65536;
+
+// how often a track whose accessor is closed gets checked for changes (ms).
+// that means opening a fresh accessor just to hash it, so not every tick
+int CLOSED_CHECK_INTERVAL_MS = 5000;
+
+// how much audio to read past the end of an item (in seconds) on tracks
+// with FX, so reverb and delay tails don't get cut off
+double ITEM_FX_TAIL = 2.0;
+
+// where a track's audio gets read from
+enum class accessor_source_t {
+    track,  // the track accessor: what the track plays, after its FX chain
+    takes   // the items' active takes, mixed by position, before the track's FX
+};
+
+// the source for tracks that don't pick their own. reading takes skips
+// rendering the track's FX, which is most of the build time on heavy tracks,
+// at the cost of not hearing what the FX do
+accessor_source_t ACCESSOR_SOURCE = accessor_source_t::track;
+
+std::string to_string(accessor_source_t source) {
+    return source == accessor_source_t::takes ? "takes" : "track";
+}
+
+std::optional<accessor_source_t> accessor_source_from_string(const std::string& str) {
+    if (str == "track")
+        return accessor_source_t::track;
+    if (str == "takes")
+        return accessor_source_t::takes;
+    return std::nullopt;
+}
+
+class audio_accessor_t;
+
+// a take the build mixes in when it reads takes (see mix_takes).
+// planned on the main thread, so the build never touches the items
+struct take_read_t {
+    AudioAccessor* accessor {nullptr};
+    double pos {0.0};
+    double len {0.0};
+    float gain {1.0f};
+};
+
+// keeps an accessor (and the take accessors the build reads, if any) open
+// while a build reads from it (see accessor_pool_t).
+// get one from the main thread, drop it from anywhere
+class accessor_lease_t {
+public:
+    accessor_lease_t(shared_ptr<audio_accessor_t> accessor);
+    ~accessor_lease_t();
 
-// wraps an audio accessor
-class audio_accessor_t {
+    // leases a take accessor the build reads too
+    void add_take(const take_read_t& take);
+    const vec<take_read_t>& takes() const { return m_takes; }
+
+    // where the build reads (see audio_accessor_t::item_extents)
+    void set_extents(vec<pair<double, double>> extents) { m_extents = std::move(extents); }
+    const vec<pair<double, double>>& extents() const { return m_extents; }
+
+private:
+    shared_ptr<audio_accessor_t> m_accessor;
+    vec<take_read_t> m_takes;
+    vec<pair<double, double>> m_extents;
+};
+
+// wraps an audio accessor. the REAPER accessor itself is only open while
+// we need it: it's opened on demand, and the accessor pool closes it once
+// it sits idle. the hash of the audio from the last build is kept around,
+// so we can still tell if the audio changed after the accessor was closed.
+// open, close and check from the main thread; read with a lease
+class audio_accessor_t : public std::enable_shared_from_this<audio_accessor_t> {
 public:
     audio_accessor_t(MediaTrack* track) 
-      : m_accessor(CreateTrackAudioAccessor(track)), m_track(track) { };
+      : m_track(track) { };
 
     ~audio_accessor_t() { 
+        // https://github.com/reaper-oss/sws/blob/bcc8fbc96f30a943bd04fb8030b4a03ea1ff7557/Breeder/BR_Loudness.cpp#L246
+        bool project_open = EnumProjects(0, NULL, 0);
         if(m_accessor) { 
-            // https://github.com/reaper-oss/sws/blob/bcc8fbc96f30a943bd04fb8030b4a03ea1ff7557/Breeder/BR_Loudness.cpp#L246
-            if (EnumProjects(0, NULL, 0))
+            accessor_pool().closed(this);
+            if (project_open)
                 DestroyAudioAccessor(m_accessor); 
         } 
+        for (auto [take, accessor] : m_take_accessors) {
+            accessor_pool().closed(accessor);
+            if (project_open)
+                DestroyAudioAccessor(accessor);
+        }
     };
 
-    void reset() {
-        if (m_accessor) { DestroyAudioAccessor(m_accessor); }
+    // opens the REAPER accessor if it isn't open yet
+    void open() {
+        if (m_accessor) {
+            accessor_pool().touch(this);
+            return;
+        }
+
+        accessor_pool().make_room();
         m_accessor = CreateTrackAudioAccessor(m_track);
+        if (!m_accessor)
+            return;
+
+        std::weak_ptr<audio_accessor_t> weak = weak_from_this();
+        accessor_pool().opened(this, [weak]() {
+            if (auto accessor = weak.lock())
+                accessor->close();
+        });
+    }
+
+    // closes the REAPER accessor (the pool does this for us)
+    void close() {
+        if (!m_accessor)
+            return;
+        accessor_pool().closed(this);
+        DestroyAudioAccessor(m_accessor);
+        m_accessor = nullptr;
     }
 
-    bool get_samples(std::vector<double>& buffer) {
-        // TODO: if audio is longer than 28800000 samples (arbitrary, 
-        // then ask for the samples in chunks. 
+    void reset() {
+        close();
+        open();
+    }
+
+    // opens the accessor, and keeps it open until the lease is dropped.
+    // the build reads from whatever source() is at this point, and the
+    // lease brings along everything it needs to know about the items
+    // (where they are, and the takes if it reads those), so the build
+    // never has to look at them from its thread
+    shared_ptr<accessor_lease_t> lease() {
+        open();
+        m_build_source = source();
+        auto lease = std::make_shared<accessor_lease_t>(shared_from_this());
+        lease->set_extents(item_extents());
+        if (m_build_source == accessor_source_t::takes)
+            plan_takes(*lease);
+        return lease;
+    }
+
+    // where this track's audio gets read from. tracks that get audio from
+    // somewhere other than their own items have no takes to read, so they
+    // always use the track accessor
+    accessor_source_t source() const {
+        if (gets_routed_audio())
+            return accessor_source_t::track;
+        return m_source.value_or(ACCESSOR_SOURCE);
+    }
+
+    // pick a source for this track (nullopt goes back to ACCESSOR_SOURCE)
+    void set_source(std::optional<accessor_source_t> source) {
+        m_source = source;
+    }
+
+    // true if the track follows ACCESSOR_SOURCE
+    bool uses_global_source() const {
+        return !m_source && !gets_routed_audio();
+    }
+
+    // true if the last build read from some other source than
+    // source() is now. the hash can't tell, it only sees the track
+    bool source_changed() {
+        return !last_hash().empty() && source() != m_build_source;
+    }
+
+    // reads the samples under the track's items, one segment per run of
+    // (overlapping) items. gaps between items aren't read at all, 
+    // since they're silence anyway. needs the build's lease
+    bool get_samples(vec<sample_segment_t>& segments, const accessor_lease_t& lease) {
+        segments.clear();
         if (!this->is_valid()) {
             // info("got invalid audio accessor for track {:x}", (void*)m_track);
             return false;
         }
 
-        double t_start = GetAudioAccessorStartTime(m_accessor);
-        double t_end = GetAudioAccessorEndTime(m_accessor);
-        m_time_bounds = std::make_pair(t_start, t_end);
+        auto [t_start, t_end] = update_time_bounds();
 
         debug("mipmap: accessor start time: {}; end time: {};", t_start, t_end);
         if (t_end <= t_start) {
             info("mipmap: accessor end time is less than or equal to start time");
             return false;
         }
-        
-        // calculate the number of samples we want to collect per channel
-        int samples_per_channel = sample_rate() * (t_end - t_start);
-        buffer.resize(samples_per_channel * num_channels());
 
-        int result = GetAudioAccessorSamples(m_accessor, sample_rate(), num_channels(), 
-                                                    t_start, samples_per_channel, 
-                                                    buffer.data());
+        int sr = sample_rate();
+        int nch = num_channels();
 
-        if (result == 0){
-            info("no audio");
-        } else if (result < 1) {
-            info("failed to get samples from accessor: error: {}", result);
-            return false;
-        } else {
-            debug("got result {} from accessor", result);
+        vec<double> window((size_t)ACCESSOR_WINDOW * nch);
+        for (auto [seg_start, seg_end] : lease.extents()) {
+            seg_start = std::max(seg_start, t_start);
+            seg_end = std::min(seg_end, t_end);
+            if (seg_end <= seg_start)
+                continue;
+            if (!read_segment(segments, seg_start, seg_end, sr, nch, window, lease))
+                return false;
         }
+        debug("accessor: read {} segments", segments.size());
 
         return true;
     }
 
+    // reads everything from t_from to the end of the track as one segment
+    // (nothing if there's nothing new). for picking up where an earlier 
+    // read left off, while the track grows
+    bool get_samples_from(vec<sample_segment_t>& segments, double t_from,
+                          const accessor_lease_t& lease) {
+        segments.clear();
+        if (!this->is_valid())
+            return false;
+
+        auto [t_start, t_end] = get_time_bounds();
+        int sr = sample_rate();
+        int nch = num_channels();
+        vec<double> window((size_t)ACCESSOR_WINDOW * nch);
+        return read_segment(segments, std::max(t_from, t_start), t_end, sr, nch, window, lease);
+    }
+
+    // the time ranges where the track can make sound (the build clamps
+    // them to the accessor's bounds). that's the unmuted items, merged where
+    // they overlap (or nearly do), plus a bit of room after each one for
+    // FX tails. tracks that get audio from somewhere other than their own
+    // items (the master, folders, receives) are read in full.
+    // main thread only (see lease)
+    vec<pair<double, double>> item_extents() const {
+        vec<pair<double, double>> extents;
+        if (gets_routed_audio()) {
+            extents.emplace_back(std::numeric_limits<double>::lowest(),
+                                 std::numeric_limits<double>::max());
+            return extents;
+        }
+
+        // takes are read before the FX, so they have no tails
+        bool has_tails = m_build_source == accessor_source_t::track && TrackFX_GetCount(m_track) > 0;
+        double tail = has_tails ? ITEM_FX_TAIL : 0.0;
+        int num_items = CountTrackMediaItems(m_track);
+        for (int i = 0; i < num_items; i++) {
+            MediaItem* item = GetTrackMediaItem(m_track, i);
+            if (GetMediaItemInfo_Value(item, "B_MUTE") != 0)
+                continue;
+
+            double pos = GetMediaItemInfo_Value(item, "D_POSITION");
+            double len = GetMediaItemInfo_Value(item, "D_LENGTH");
+            if (len > 0)
+                extents.emplace_back(pos, pos + len + tail);
+        }
+
+        // items are sorted by position, but their tails can overlap
+        std::sort(extents.begin(), extents.end());
+        vec<pair<double, double>> merged;
+        for (auto& extent : extents) {
+            if (!merged.empty() && extent.first - merged.back().second < ITEM_MERGE_GAP)
+                merged.back().second = std::max(merged.back().second, extent.second);
+            else
+                merged.push_back(extent);
+        }
+        return merged;
+    }
+
+    // the master, folders, and tracks with receives
+    bool gets_routed_audio() const {
+        return GetMediaTrackInfo_Value(m_track, "IP_TRACKNUMBER") == -1
+            || GetMediaTrackInfo_Value(m_track, "I_FOLDERDEPTH") > 0
+            || GetTrackNumSends(m_track, -1) > 0;
+    }
+
     pair<double, double> get_time_bounds() { return m_time_bounds; }
 
+    // refresh the time bounds without reading any samples
+    pair<double, double> update_time_bounds() {
+        m_time_bounds = std::make_pair(GetAudioAccessorStartTime(m_accessor), 
+                                       GetAudioAccessorEndTime(m_accessor));
+        return m_time_bounds;
+    }
+
+    // these come from the project state cache, so they're cheap
+    // to call from anywhere (see project_state_cache_t)
     int num_channels() const { 
-        return (int)GetMediaTrackInfo_Value(m_track, "I_NCHAN"); 
+        int cached = project_state().get()->num_channels(m_track);
+        // tracks created since the last refresh aren't cached yet
+        return cached > 0 ? cached : (int)GetMediaTrackInfo_Value(m_track, "I_NCHAN"); 
     }
 
     static int sample_rate() {
-        GetSetProjectInfo(0, "PROJECT_SRATE_USE", 1, true);
-        return (int)GetSetProjectInfo(0, "PROJECT_SRATE", 0, true); 
+        return project_state().get()->sample_rate; 
     }
 
+    // true if the audio changed since the last update().
+    // if the accessor is closed, we open a fresh one and compare hashes
+    // (at most every CLOSED_CHECK_INTERVAL_MS). it only stays open if the
+    // audio changed (the rebuild needs it then).
+    // asking doesn't count as using the accessor, or the pool would
+    // never find one idle
     bool state_changed() {
-        return AudioAccessorStateChanged(m_accessor);
+        if (m_accessor)
+            return AudioAccessorStateChanged(m_accessor);
+
+        std::string last_hash = this->last_hash();
+        // never read, the first build takes care of it
+        if (last_hash.empty())
+            return false;
+
+        auto now = std::chrono::steady_clock::now();
+        if (now - m_last_closed_check < std::chrono::milliseconds(CLOSED_CHECK_INTERVAL_MS))
+            return false;
+        m_last_closed_check = now;
+
+        open();
+        bool changed = m_accessor && hash() != last_hash;
+        if (!changed)
+            close();
+        return changed;
+    }
+
+    // brings the accessor up to date without reading anything, so
+    // state_changed() only says yes again after the next change.
+    // main thread, and never while a build is reading from it
+    void catch_up() {
+        if (m_accessor)
+            AudioAccessorUpdate(m_accessor);
     }
 
+    // brings the accessor up to date with the track, and remembers the
+    // hash of its audio. needs a lease
     void update() {
         AudioAccessorUpdate(m_accessor);
         AudioAccessorValidateState(m_accessor);
+
+        std::string hash = this->hash();
+        std::lock_guard<std::mutex> lock(m_hash_mutex);
+        m_hash = hash;
     }
 
     AudioAccessor* get() { return m_accessor; };
@@ -88,8 +359,192 @@ public:
         return m_accessor; 
     };
     
+    // true if the track is armed for recording
+    bool record_armed() const {
+        return GetMediaTrackInfo_Value(m_track, "I_RECARM") != 0;
+    }
+
 private:
+    // reads seg_start to seg_end into a new segment, from the track 
+    // or from the takes (see m_build_source). window is scratch space
+    bool read_segment(vec<sample_segment_t>& segments, double seg_start, double seg_end,
+                      int sr, int nch, vec<double>& window, const accessor_lease_t& lease) {
+        // calculate the number of samples we want to collect per channel
+        int samples_per_channel = sr * (seg_end - seg_start);
+        if (samples_per_channel <= 0)
+            return true;
+
+        sample_segment_t& segment = segments.emplace_back();
+        segment.t_start = seg_start;
+        segment.samples.resize((size_t)samples_per_channel * nch);
+
+        if (m_build_source == accessor_source_t::takes) {
+            mix_takes(segment, seg_end, sr, nch, window, lease.takes());
+            return true;
+        }
+
+        // REAPER only hands out doubles. we read them a window at a time
+        // and convert to floats as we go, so we never hold a double copy
+        // of a whole segment (this also keeps each read a sane size)
+        for (int done = 0; done < samples_per_channel; done += ACCESSOR_WINDOW) {
+            int count = std::min(ACCESSOR_WINDOW, samples_per_channel - done);
+            int result = GetAudioAccessorSamples(m_accessor, sr, nch, 
+                                                 seg_start + (double)done / sr, count, 
+                                                 window.data());
+            if (result < 0) {
+                info("failed to get samples from accessor: error: {}", result);
+                return false;
+            }
+
+            float* dst = segment.samples.data() + (size_t)done * nch;
+            if (result == 0) {
+                // no audio here
+                std::fill(dst, dst + count * nch, 0.0f);
+                continue;
+            }
+            for (int i = 0; i < count * nch; i++)
+                dst[i] = (float)window[i];
+        }
+        debug("accessor: read {} to {}", seg_start, seg_end);
+        metrics().accessor_samples_read.add(segment.samples.size());
+        return true;
+    }
+
+    // adds the planned takes under the segment (which ends at seg_end)
+    // into it, where they sit on the timeline. take accessors don't render
+    // the track's FX. window is scratch space for the reads
+    void mix_takes(sample_segment_t& segment, double seg_end, int sr, int nch,
+                   vec<double>& window, const vec<take_read_t>& takes) {
+        int seg_samples = segment.samples.size() / nch;
+        for (const take_read_t& take : takes) {
+            double start = std::max(take.pos, segment.t_start);
+            double end = std::min(take.pos + take.len, seg_end);
+            if (end <= start)
+                continue;
+
+            // take accessors count time from the start of the item
+            int first = (start - segment.t_start) * sr;
+            int samples_per_channel = std::min((int)((end - start) * sr), seg_samples - first);
+            for (int done = 0; done < samples_per_channel; done += ACCESSOR_WINDOW) {
+                int count = std::min(ACCESSOR_WINDOW, samples_per_channel - done);
+                int result = GetAudioAccessorSamples(take.accessor, sr, nch, 
+                                                     start - take.pos + (double)done / sr, count, 
+                                                     window.data());
+                if (result <= 0)
+                    continue;
+
+                float* dst = segment.samples.data() + (size_t)(first + done) * nch;
+                for (int j = 0; j < count * nch; j++)
+                    dst[j] += take.gain * (float)window[j];
+            }
+            metrics().accessor_samples_read.add((size_t)samples_per_channel * nch);
+        }
+        debug("accessor: mixed the takes from {} to {}", segment.t_start, seg_end);
+    }
+
+    // adds the active takes of the unmuted items to the lease, with their
+    // accessors open (and up to date) so the build can read them.
+    // each one is leased right away, so opening the next can't close it.
+    // main thread only
+    void plan_takes(accessor_lease_t& lease) {
+        int num_items = CountTrackMediaItems(m_track);
+        for (int i = 0; i < num_items; i++) {
+            MediaItem* item = GetTrackMediaItem(m_track, i);
+            MediaItem_Take* take = GetActiveTake(item);
+            if (!take || GetMediaItemInfo_Value(item, "B_MUTE") != 0)
+                continue;
+
+            AudioAccessor* accessor = open_take(take);
+            if (!accessor)
+                continue;
+
+            // (negative take volume flips the polarity)
+            lease.add_take({accessor,
+                            GetMediaItemInfo_Value(item, "D_POSITION"),
+                            GetMediaItemInfo_Value(item, "D_LENGTH"),
+                            (float)(GetMediaItemInfo_Value(item, "D_VOL")
+                                  * GetMediaItemTakeInfo_Value(take, "D_VOL"))});
+        }
+    }
+
+    // take accessors go through the pool like ours, and stay open between
+    // builds until they sit idle. a build needs all of its takes at once,
+    // so a track with lots of items can go over MAX_LIVE_ACCESSORS for a bit
+    AudioAccessor* open_take(MediaItem_Take* take) {
+        auto it = m_take_accessors.find(take);
+        if (it != m_take_accessors.end()) {
+            accessor_pool().touch(it->second);
+            if (AudioAccessorStateChanged(it->second))
+                AudioAccessorUpdate(it->second);
+            return it->second;
+        }
+
+        accessor_pool().make_room();
+        AudioAccessor* accessor = CreateTakeAudioAccessor(take);
+        if (!accessor)
+            return nullptr;
+
+        m_take_accessors[take] = accessor;
+        std::weak_ptr<audio_accessor_t> weak = weak_from_this();
+        accessor_pool().opened(accessor, [weak, take]() {
+            if (auto owner = weak.lock())
+                owner->close_take(take);
+        });
+        return accessor;
+    }
+
+    void close_take(MediaItem_Take* take) {
+        auto it = m_take_accessors.find(take);
+        if (it == m_take_accessors.end())
+            return;
+        accessor_pool().closed(it->second);
+        DestroyAudioAccessor(it->second);
+        m_take_accessors.erase(it);
+    }
+
+    // changes only if the samples do
+    std::string hash() const {
+        char hash[128] = {0};
+        GetAudioAccessorHash(m_accessor, hash);
+        return hash;
+    }
+
+    std::string last_hash() {
+        std::lock_guard<std::mutex> lock(m_hash_mutex);
+        return m_hash;
+    }
+
     pair<double, double> m_time_bounds;
     AudioAccessor* m_accessor {nullptr};
     MediaTrack* m_track {nullptr};
-};
\ No newline at end of file
+
+    // this track's own source, if it picked one
+    std::optional<accessor_source_t> m_source;
+    // the source the current build reads from (set when it's leased)
+    accessor_source_t m_build_source {accessor_source_t::track};
+    // open take accessors, by take (see open_take). main thread only
+    std::map<MediaItem_Take*, AudioAccessor*> m_take_accessors;
+
+    // when state_changed() last opened a closed accessor to check it
+    std::chrono::steady_clock::time_point m_last_closed_check {};
+
+    // the hash as of the last update(), written by the build
+    std::string m_hash;
+    std::mutex m_hash_mutex;
+};
+
+accessor_lease_t::accessor_lease_t(shared_ptr<audio_accessor_t> accessor)
+  : m_accessor(accessor) {
+    accessor_pool().lease(m_accessor.get());
+}
+
+void accessor_lease_t::add_take(const take_read_t& take) {
+    accessor_pool().lease(take.accessor);
+    m_takes.push_back(take);
+}
+
+accessor_lease_t::~accessor_lease_t() {
+    accessor_pool().unlease(m_accessor.get());
+    for (const take_read_t& take : m_takes)
+        accessor_pool().unlease(take.accessor);
+}
\ No newline at end of file
@@ -0,0 +1,132 @@
+#pragma once
+
+#include "metrics.h"
+#include "log.h"
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+
+// how many REAPER audio accessors can be open at once, across all tracks.
+// each one keeps render state for the track's FX chain around
+int MAX_LIVE_ACCESSORS = 16;
+// accessors nobody used for this long get closed (ms)
+int ACCESSOR_IDLE_MS = 10000;
+
+// keeps the number of open audio accessors in check. accessors get opened
+// when a build or a freshness check needs one, and closed again once they
+// sit idle, or when we need room for another one (least recently used
+// first). accessors that are leased (a build is reading from them) are
+// never closed.
+// thread safe, but only open and close accessors from the main thread
+class accessor_pool_t {
+public:
+    using clock = std::chrono::steady_clock;
+    using owner_id = const void*;
+    // closes the owner's accessor. runs outside of our lock,
+    // so it can call back into us
+    using close_closure_t = std::function<void()>;
+
+    // an owner is about to open an accessor. closes others until there's room
+    void make_room() {
+        while (auto close = pick([this](const entry_t&) { return m_open.size() >= MAX_LIVE_ACCESSORS; }))
+            close();
+    }
+
+    // an owner opened its accessor
+    void opened(owner_id owner, close_closure_t close) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_open[owner] = {close, clock::now(), 0};
+        metrics().accessors_opened.add();
+        metrics().live_accessors.set(m_open.size());
+    }
+
+    // an owner closed its accessor
+    void closed(owner_id owner) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_open.erase(owner))
+            metrics().accessors_closed.add();
+        metrics().live_accessors.set(m_open.size());
+    }
+
+    // the owner's accessor was just used
+    void touch(owner_id owner) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_open.find(owner);
+        if (it != m_open.end())
+            it->second.last_used = clock::now();
+    }
+
+    // leased accessors stay open until they're returned
+    void lease(owner_id owner) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_open.find(owner);
+        if (it != m_open.end()) {
+            it->second.leases++;
+            it->second.last_used = clock::now();
+        }
+    }
+
+    void unlease(owner_id owner) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_open.find(owner);
+        if (it != m_open.end()) {
+            it->second.leases--;
+            it->second.last_used = clock::now();
+        }
+    }
+
+    // close the accessors that sat idle for too long.
+    // call this every once in a while, from the main thread
+    void collect() {
+        auto idle = std::chrono::milliseconds(ACCESSOR_IDLE_MS);
+        auto now = clock::now();
+        while (auto close = pick([&](const entry_t& entry) { return now - entry.last_used > idle; })) {
+            debug("accessor pool: closing an idle accessor");
+            close();
+        }
+    }
+
+    size_t live() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_open.size();
+    }
+
+private:
+    struct entry_t {
+        close_closure_t close;
+        clock::time_point last_used;
+        int leases {0};
+    };
+
+    // the least recently used accessor that isn't leased and that
+    // should_close agrees with. we forget about it right away, so the same
+    // one never gets picked twice. returns an empty closure if there's none
+    close_closure_t pick(const std::function<bool(const entry_t&)>& should_close) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto victim = m_open.end();
+        for (auto it = m_open.begin(); it != m_open.end(); it++) {
+            if (it->second.leases == 0
+                && (victim == m_open.end() || it->second.last_used < victim->second.last_used))
+                victim = it;
+        }
+        if (victim == m_open.end() || !should_close(victim->second))
+            return {};
+
+        close_closure_t close = victim->second.close;
+        m_open.erase(victim);
+        metrics().accessors_closed.add();
+        metrics().live_accessors.set(m_open.size());
+        return close;
+    }
+
+    std::mutex m_mutex;
+    std::map<owner_id, entry_t> m_open;
+};
+
+// the process-wide accessor pool
+accessor_pool_t& accessor_pool() {
+    static accessor_pool_t pool;
+    return pool;
+}
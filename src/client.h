@@ -0,0 +1,244 @@
+#pragma once
+#include "include/oscpkt/udp.hh"
+
+#include "reaper_plugin_functions.h"
+#include "pixel.h"
+#include "project_state.h"
+#include "log.h"
+
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+
+// how often we ping every client (ms)
+int HEARTBEAT_INTERVAL = 1000;
+// how long we wait for a /ping_ack before counting the ping as lost (ms)
+int PING_TIMEOUT = 2000;
+// how much the newest ping moves the loss estimate (0 to 1)
+double LOSS_SMOOTHING = 0.125;
+// how far we stretch the packet interval for slow links (see pacing_interval_us)
+double PACING_LOSS_GAIN = 10.0;
+int PACING_MAX_US = 20000;
+// clients we haven't heard from for this long are forgotten (ms)
+int CLIENT_TIMEOUT = 30000;
+
+// how far ahead of the playhead we push pixels to clients following 
+// playback (ms). stretched on links that need longer (see follow_lookahead)
+int FOLLOW_LOOKAHEAD_MS = 500;
+// how much playback a single pushed window covers (ms)
+int FOLLOW_WINDOW_MS = 100;
+
+// how pixels are encoded on the way to a client
+enum class pixel_format_t {
+    json,       // one {id, value} object per pixel
+    quantized   // 8-bit intensities in a blob (see haptic_quant_block_t)
+};
+
+// what a single client is looking at.
+// this is a plain value so it can be copied into worker tasks
+struct client_view_t {
+    // 1-based track number, -1 is the master track,
+    // and 0 follows REAPER's track selection
+    int track {0};
+    int channel {0};
+
+    // resolution the client is browsing at.
+    // nullopt follows REAPER's zoom level
+    std::optional<double> pix_per_s {std::nullopt};
+
+    // send pacing: how many pixels go in a single packet,
+    // and how long to wait between packets
+    size_t chunk_size {128};
+    int chunk_interval_us {1};
+
+    pixel_format_t format {pixel_format_t::json};
+
+    // how many pixels the client can render (or feel) at once. 
+    // ranges wider than this get decimated. 0 means no limit
+    int viewport_width {0};
+
+    // push pixels ahead of the playhead during playback (see /follow),
+    // this far ahead (ms, 0 for FOLLOW_LOOKAHEAD_MS)
+    bool follow {false};
+    int follow_lookahead_ms {0};
+
+    double pps() const { return pix_per_s.value_or(project_state().get()->hzoom); }
+};
+
+// the health of the link to a client, from timestamped pings.
+// rtt and jitter are smoothed like TCP's srtt and rttvar (RFC 6298), and
+// loss is a moving average of the pings that never got an answer.
+// times are in seconds (see time_precise).
+// thread safe
+class client_health_t {
+public:
+    // a ping is going out. returns its sequence number
+    int ping_sent(double now) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_first_ping < 0)
+            m_first_ping = now;
+        m_outstanding[m_next_seq] = now;
+        return m_next_seq++;
+    }
+
+    // a /ping_ack came in. clients that don't echo the sequence
+    // number (seq < 0) are matched with the latest ping
+    void ack_received(int seq, double now) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = seq < 0 && !m_outstanding.empty() 
+                    ? std::prev(m_outstanding.end()) 
+                    : m_outstanding.find(seq);
+        m_last_ack = now;
+        m_last_heard = now;
+        if (it == m_outstanding.end())
+            return;
+
+        double rtt = now - it->second;
+        m_outstanding.erase(it);
+
+        if (!m_has_rtt) {
+            m_srtt = rtt;
+            m_rttvar = rtt / 2;
+            m_has_rtt = true;
+        } else {
+            m_rttvar = 0.75 * m_rttvar + 0.25 * std::abs(m_srtt - rtt);
+            m_srtt = 0.875 * m_srtt + 0.125 * rtt;
+        }
+        m_loss *= 1.0 - LOSS_SMOOTHING;
+    }
+
+    // the client sent us something (anything counts as a sign of life)
+    void heard_from(double now) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_last_heard = now;
+    }
+
+    // how long since we last heard from the client, counting from the
+    // first ping if we never did. 0 until we've pinged it
+    double silent_for(double now) const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        double since = m_last_heard >= 0 ? m_last_heard : m_first_ping;
+        return since >= 0 ? now - since : 0.0;
+    }
+
+    // pings that have been waiting too long count as lost
+    void expire(double now) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        double timeout = PING_TIMEOUT / 1000.0;
+        for (auto it = m_outstanding.begin(); it != m_outstanding.end();) {
+            if (now - it->second < timeout) {
+                ++it;
+                continue;
+            }
+            m_loss = m_loss * (1.0 - LOSS_SMOOTHING) + LOSS_SMOOTHING;
+            it = m_outstanding.erase(it);
+        }
+    }
+
+    // true if the client answered a ping recently
+    bool alive(double now) const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_last_ack >= 0 
+            && now - m_last_ack < (HEARTBEAT_INTERVAL + PING_TIMEOUT) / 1000.0;
+    }
+
+    // how long to wait between packets. the client asks for an interval
+    // (see /set_pacing), and we stretch it when the link looks congested:
+    // in proportion to the loss, and to at least an eighth of the jitter,
+    // so we stop bursting into a queue that's already backed up
+    int pacing_interval_us(int requested) const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        double interval = requested * (1.0 + m_loss * PACING_LOSS_GAIN);
+        interval = std::max(interval, m_rttvar * 1e6 / 8);
+        return (int)std::min(interval, (double)std::max(PACING_MAX_US, requested));
+    }
+
+    // how long a packet might take to get there and back, with room
+    // for jitter (like TCP's retransmission timeout). 0 until we know
+    double rto() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_has_rtt ? m_srtt + 4 * m_rttvar : 0.0;
+    }
+
+    json to_json(double now) const {
+        bool is_alive = alive(now);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return {
+            {"alive", is_alive},
+            {"rtt_ms", m_srtt * 1000},
+            {"jitter_ms", m_rttvar * 1000},
+            {"loss", m_loss},
+            {"pending", m_outstanding.size()}
+        };
+    }
+
+private:
+    mutable std::mutex m_mutex;
+    std::map<int, double> m_outstanding; // sequence number -> when it was sent
+    int m_next_seq {0};
+    bool m_has_rtt {false};
+    double m_srtt {0};
+    double m_rttvar {0};
+    double m_loss {0};
+    double m_last_ack {-1};
+    double m_last_heard {-1};
+    double m_first_ping {-1};
+};
+
+// how far playback follow got for a client: the windows it was sent
+// cover every pixel before next_pix, on that track at that resolution
+struct follow_state_t {
+    const void* track {nullptr};
+    double pix_per_s {0.0};
+    int next_pix {-1}; // -1 when nothing's been sent
+
+    void reset() { *this = follow_state_t(); }
+};
+
+// one haptic device talking to us, keyed by its ip address.
+// we always reply to the same port, since the client listens on
+// a fixed port, but sends from whatever port its OS hands it.
+class osc_client_t {
+public:
+    osc_client_t(const std::string& addr, int port)
+      : m_addr(addr), m_port(port) {}
+
+    bool connect() {
+        info("client: connecting to {}:{}", m_addr, m_port);
+        m_connected_sock = m_sock.connectTo(m_addr, m_port);
+        if (!m_connected_sock)
+            warn("client: failed to connect to {}:{}: {}", m_addr, m_port, m_sock.errorMessage());
+        return m_connected_sock;
+    }
+
+    bool send_packet(const void* data, size_t size) {
+        if (!m_connected_sock) { return false; }
+        return m_sock.sendPacket(data, size);
+    }
+
+    const std::string& addr() const { return m_addr; }
+    bool connected() const { return m_connected_sock; }
+
+    // only touched from the main thread (osc callbacks and Run)
+    client_view_t view;
+
+    // updated by the heartbeat, read by anyone
+    client_health_t health;
+    // only touched from the main thread (see controller's follow_playback)
+    follow_state_t follow;
+
+    // how far ahead of the playhead to push pixels, in seconds: what
+    // the client asked for, or more if the link is slow enough that
+    // windows wouldn't get there in time otherwise
+    double follow_lookahead() const {
+        int lookahead_ms = view.follow_lookahead_ms > 0 ? view.follow_lookahead_ms : FOLLOW_LOOKAHEAD_MS;
+        return std::max(lookahead_ms / 1000.0, 2 * health.rto());
+    }
+
+private:
+    std::string m_addr;
+    int m_port {0};
+    bool m_connected_sock {false};
+    oscpkt::UdpSocket m_sock;
+};
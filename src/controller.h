@@ -1,19 +1,28 @@
 #pragma once
 
 #include "haptic_track.h"
+#include "meter.h"
 #include "mipmap.h"
 #include "osc.h"
+#include "view_cache.h"
 #include "log.h"
 
 #include <iostream>
 #include <chrono>
+#include <set>
 #include <thread>
 
 #define project nullptr
 
 using std::unique_ptr;
 
-int TIMEOUT = 2000;
+int STATS_DUMP_INTERVAL = 10000; // ms
+// how long Run can spend checking tracks nobody's looking at 
+// for changes, every tick (us)
+int STALENESS_BUDGET_US = 1000;
+// quantized pixels are ~10x smaller than json ones, 
+// so we fit that many more in a packet
+int QUANTIZED_CHUNK_FACTOR = 10;
 
 enum class controller_mode {
     mipmap, 
@@ -33,6 +42,8 @@ public:
     virtual const char* GetConfigString() override { return ""; }
 
     bool init () {
+        project_state().refresh();
+        project_state().refresh_tracks();
         bool success = m_manager->init();
         // TODO: we should have a pointer to an
         // active track object 
@@ -49,6 +60,125 @@ public:
         info("set {} as the active track", (void*)trackid);
     };
 
+    void SetPlayState(bool play, bool pause, bool rec) override {
+        bool was_recording = project_state().get()->recording();
+        project_state().set_play_state(play, pause, rec);
+
+        // a recording just ended, some tracks have new audio
+        if (was_recording && !rec)
+            suspect_all_tracks();
+    }
+
+    void SetTrackListChange() override {
+        // tracks came or went, pick up their channel counts. 
+        // moving tracks in and out of folders changes what they sound like
+        project_state().refresh_tracks();
+        release_deleted_tracks();
+        suspect_all_tracks();
+    }
+
+    // forget about tracks that were deleted. the workers might still
+    // hold on to some of them, they go away when the workers are done.
+    // waiting for a track's build to finish would stall REAPER, so one of
+    // our workers waits, and hands the track back to Run to be dropped
+    // (its accessors have to be destroyed on the main thread)
+    void release_deleted_tracks() {
+        for (auto& track : m_tracks.prune()) {
+            m_dirty_tracks.erase(track);
+            m_suspect_tracks.erase(track);
+            {
+                std::lock_guard<std::mutex> lock(m_changed_mutex);
+                m_changed_tracks.erase(track);
+                m_improved_tracks.erase(track);
+            }
+
+            m_pool.enqueue([this, track]() {
+                track->stop();
+                std::lock_guard<std::mutex> lock(m_released_mutex);
+                m_released_tracks.push_back(track);
+            });
+        }
+    }
+
+    // drops the deleted tracks whose builds are done (see release_deleted_tracks)
+    void drop_released_tracks() {
+        vec<shared_ptr<haptic_track_t>> released;
+        {
+            std::lock_guard<std::mutex> lock(m_released_mutex);
+            released.swap(m_released_tracks);
+        }
+    }
+
+    void SetSurfaceMute(MediaTrack* trackid, bool mute) override {
+        // muting a track changes what its folder sounds like
+        suspect_all_tracks();
+    }
+
+    virtual int Extended(int call, void* parm1, void* parm2, void* parm3) override {
+        switch (call) {
+            // fx added, removed, bypassed, or tweaked. parm1 is the track.
+            // automation tweaks params all the time during playback,
+            // so those wait for the staleness check
+            case CSURF_EXT_SETFXPARAM:
+                if (project_state().get()->playing())
+                    break;
+                [[fallthrough]];
+            case CSURF_EXT_SETFXCHANGE:
+            case CSURF_EXT_SETFXENABLED:
+                // tracks that read their takes don't hear their FX
+                if (auto track = m_tracks.find((MediaTrack*)parm1);
+                    track && track->source() != accessor_source_t::takes)
+                    mark_dirty(track);
+                break;
+
+            // tempo changes move items around
+            case CSURF_EXT_SETBPMANDPLAYRATE:
+            case CSURF_EXT_RESET:
+                suspect_all_tracks();
+                break;
+        }
+        return 0;
+    }
+
+    // rebuild a track's mipmap, even if nobody's looking at it
+    void mark_dirty(shared_ptr<haptic_track_t> track) {
+        track->invalidate();
+        m_dirty_tracks.insert(track);
+    }
+
+    // something happened that might have changed any track. 
+    // they get checked (within the time budget) before the round robin
+    void suspect_all_tracks() {
+        for (auto& track : m_tracks.all())
+            m_suspect_tracks.insert(track);
+    }
+
+    // checks tracks nobody's looking at for changes, within 
+    // STALENESS_BUDGET_US: suspects first, then round robin, 
+    // so the per tick cost doesn't grow with the session
+    void check_stale_tracks(const std::set<shared_ptr<haptic_track_t>>& viewed) {
+        double deadline = time_precise() + STALENESS_BUDGET_US / 1e6;
+        auto check = [&](const shared_ptr<haptic_track_t>& track) {
+            project_state().refresh_track(track->get_track());
+            // nobody reads from the caches of tracks nobody's looking at
+            if (!viewed.count(track))
+                track->clear_cached_blocks();
+            if (!viewed.count(track) && !m_dirty_tracks.count(track) && track->stale()) {
+                debug("track {} changed while nobody was looking", track->get_track_number());
+                mark_dirty(track);
+            }
+        };
+
+        while (!m_suspect_tracks.empty() && time_precise() < deadline) {
+            check(*m_suspect_tracks.begin());
+            m_suspect_tracks.erase(m_suspect_tracks.begin());
+        }
+
+        auto all = m_tracks.all();
+        for (size_t i = 0; i < all.size() && time_precise() < deadline; i++)
+            check(all[m_stale_cursor++ % all.size()]);
+    }
+
     void SetSurfaceSelected(MediaTrack* trackid, bool selected) override {
         if (!selected) {
             return;
@@ -60,71 +190,295 @@ public:
         info("setsurface: set {} as the active track", (void*)trackid);
     }
 
-    void send_pixel(int mipmap_idx) {
-        shared_ptr<haptic_track_t> active_track = m_tracks.active();
+    // encodes a range of pixels in the client's format, split into 
+    // messages (one per packet) sent to the given address. 
+    // quantized messages go to the same address with a _q suffix
+    // decimated pixels (stride > 1) are sent with the client index of 
+    // the first pixel they cover as their id, and quantized ones carry 
+    // the stride right after the start index.
+    static vec<oscpkt::Message> encode_pixels(const vec<audio_pixel_t>& pixels, int start, int end,
+                                              const client_view_t& view, const std::string& address,
+                                              int id_offset = 0, double stride = 1.0) {
+        vec<oscpkt::Message> out;
+        auto to_id = [&](int idx) { return id_offset + (int)floor(idx * stride); };
+
+        if (view.format == pixel_format_t::quantized) {
+            size_t chunk_size = view.chunk_size * QUANTIZED_CHUNK_FACTOR;
+            haptic_quant_block_t quant_block = quantize(pixels, start, end);
+
+            for (size_t i = 0; i < quant_block.values.size(); i += chunk_size) {
+                haptic_quant_block_t chunk = quant_block.slice(i, i + chunk_size);
+
+                oscpkt::Message msg(address + "_q");
+                msg.pushInt32(to_id(chunk.start));
+                if (stride != 1.0)
+                    msg.pushFloat(stride);
+                msg.pushFloat(chunk.scale)
+                   .pushBlob(chunk.values.data(), chunk.values.size());
+                out.push_back(msg);
+            }
+            return out;
+        }
+
+        auto haptic_block = from(pixels, start, end);
+        for (haptic_pixel_t& pix : haptic_block)
+            pix.id = to_id(pix.id);
+
+        for (size_t i = 0; i < haptic_block.size(); i+= view.chunk_size) {
+            size_t last = std::min(i + view.chunk_size, haptic_block.size());
+
+            const haptic_pixel_block_t& chunk = get_view(haptic_block, i, last);
+            json j = chunk;
+
+            oscpkt::Message msg(address);
+            msg.pushStr(j.dump());
+            out.push_back(msg);
+        }
+        return out;
+    }
+
+    // the track a client is looking at
+    shared_ptr<haptic_track_t> track_for(const client_view_t& view) {
+        if (view.track == 0)
+            return m_tracks.active();
+        return m_tracks.get(view.track);
+    }
+
+    void send_pixel(shared_ptr<osc_client_t> client, int mipmap_idx) {
+        client_view_t view = client->view;
+        shared_ptr<haptic_track_t> track = track_for(view);
+        double pix_per_s = view.pps();
 
-        if (active_track) {
-            m_pool.enqueue([this, active_track, mipmap_idx]() {
+        if (track) {
+            m_pool.enqueue([this, client, track, view, pix_per_s, mipmap_idx]() {
                 info("getting pixel at {}", mipmap_idx);
-                audio_pixel_t audio_pix = active_track->get_pixel(mipmap_idx);
+                int channel = track->clamp_channel(view.channel);
+                audio_pixel_t audio_pix = track->get_pixel(mipmap_idx, channel, pix_per_s);
                 haptic_pixel_t haptic_pix(mipmap_idx, audio_pix);
 
                 oscpkt::Message msg("/pixel");
                 json j = haptic_pix;
 
                 msg.pushStr(j.dump());
-                m_manager->send(msg);
+                m_manager->send(msg, client);
             });
+            metrics().send_queue_depth.set(m_pool.queue_size());
         }
     }
 
-    void send_pixels(int start, int end) {
+    void send_pixels(shared_ptr<osc_client_t> client, int start, int end) {
         if ((end - start) < 1) {
             info("range is empty");
             return;
         }
 
-        shared_ptr<haptic_track_t> active_track = m_tracks.active();
+        client_view_t view = client->view;
+        shared_ptr<haptic_track_t> track = track_for(view);
+        double pix_per_s = view.pps();
 
-        if (active_track) {
-            m_pool.enqueue([this, active_track, start, end]() {
+        if (track) {
+            m_pool.enqueue([this, client, track, view, pix_per_s, start, end]() {
                 info("inside worker thread, getting pixels from {} to {}", start, end);
-                audio_pixel_block_t& audiopix_block = active_track->get_pixels();
+                int channel = track->clamp_channel(view.channel);
+
+                // ranges wider than the client's viewport get decimated
+                bool lod = view.viewport_width > 0 && (end - start) > view.viewport_width;
+
+                view_key_t key {
+                    track.get(), track->generation(), channel,
+                    pix_per_s, start, end, view.chunk_size, view.format,
+                    lod ? view.viewport_width : 0
+                };
+
+                // clients looking at the same range share the encoded chunks
+                auto chunks = m_view_cache.get(key, [&]() {
+                    if (lod) {
+                        audio_pixel_block_t lod_block = track->get_pixels_lod(start, end, pix_per_s, 
+                                                                              view.viewport_width);
+                        if (lod_block.get_num_pix_per_channel() == 0)
+                            return encoded_view_cache_t::chunks_t();
+
+                        const auto& lod_pixels = lod_block.get_pixels().at(channel);
+                        double stride = (double)(end - start) / lod_pixels.size();
+                        return encode_pixels(lod_pixels, 0, lod_pixels.size(), view, 
+                                             "/pixels_lod", start, stride);
+                    }
+
+                    audio_pixel_block_t audiopix_block = track->get_pixels(pix_per_s);
+                    return encode_pixels(audiopix_block.get_pixels().at(channel), 
+                                         start, end, view, "/pixels");
+                });
+
+                int interval_us = client->health.pacing_interval_us(view.chunk_interval_us);
+                for (const oscpkt::Message& msg : *chunks) {
+                    m_manager->send(msg, client);
+
+                    std::this_thread::sleep_for(std::chrono::microseconds(interval_us));
+                }
+
+                debug("pixel block sent");
+            });
+            metrics().send_queue_depth.set(m_pool.queue_size());
+        } else {
+            info("no active track, can't send pixels");
+        }
+    }
+
+    // after a rebuild, send a client only the pixels that changed
+    void send_pixels_delta(shared_ptr<osc_client_t> client, shared_ptr<haptic_track_t> track) {
+        client_view_t view = client->view;
+        double pix_per_s = view.pps();
 
-                auto haptic_block = from(audiopix_block.get_pixels()
-                                            .at(active_track->get_active_channel()), 
-                                                start, end);
+        m_pool.enqueue([this, client, track, view, pix_per_s]() {
+            vec<pixel_span_t> spans = track->mipmap()->changed_spans(pix_per_s);
+            if (spans.empty())
+                return;
 
-                size_t chunk_size = 128;
-                for (size_t i = 0; i < haptic_block.size(); i+= chunk_size) {
-                    size_t last = std::min(i + chunk_size, haptic_block.size());
+            int channel = track->clamp_channel(view.channel);
+            audio_pixel_block_t audiopix_block = track->get_pixels(pix_per_s);
 
-                    const haptic_pixel_block_t& chunk = get_view(haptic_block, i, last);
+            int interval_us = client->health.pacing_interval_us(view.chunk_interval_us);
+            int num_sent = 0;
+            for (const pixel_span_t& span : spans) {
+                auto msgs = encode_pixels(audiopix_block.get_pixels().at(channel), 
+                                          span.start, span.end, view, "/pixels_delta");
 
-                    oscpkt::Message msg("/pixels");
-                    json j = chunk;
-                    msg.pushStr(j.dump());
-                    m_manager->send(msg);
+                for (const oscpkt::Message& msg : msgs) {
+                    m_manager->send(msg, client);
 
-                    std::this_thread::sleep_for(std::chrono::microseconds(1));
+                    std::this_thread::sleep_for(std::chrono::microseconds(interval_us));
                 }
+                num_sent += span.end - span.start;
+            }
+            debug("sent {} changed pixels in {} spans to {}", num_sent, spans.size(), client->addr());
+        });
+        metrics().send_queue_depth.set(m_pool.queue_size());
+    }
 
-                debug("pixel block sent");
-            });
-        } else {
-            info("no active track, can't send pixels");
+    // push every following client the pixels coming up during playback, in
+    // windows of FOLLOW_WINDOW_MS, until it has everything up to its
+    // lookahead past the playhead. each window goes out as soon as it 
+    // enters the lookahead, so it lands well before the playhead does.
+    // seeking, stopping, or switching tracks or resolutions starts over
+    void follow_playback(const vec<shared_ptr<osc_client_t>>& clients) {
+        auto state = project_state().get();
+        for (auto& client : clients) {
+            follow_state_t& follow = client->follow;
+            shared_ptr<haptic_track_t> track = client->view.follow ? track_for(client->view) : nullptr;
+            if (!track || !state->playing()) {
+                follow.reset();
+                continue;
+            }
+
+            double pix_per_s = client->view.pps();
+            int playhead = track->time_to_mip_map_idx(state->play_position, pix_per_s);
+            int horizon = track->time_to_mip_map_idx(state->play_position + client->follow_lookahead(), 
+                                                     pix_per_s);
+            int window = std::max((int)ceil(FOLLOW_WINDOW_MS / 1000.0 * pix_per_s), 1);
+
+            if (follow.track != track.get() || follow.pix_per_s != pix_per_s
+                || follow.next_pix < playhead || follow.next_pix > horizon + window) {
+                follow = {track.get(), pix_per_s, playhead};
+            }
+
+            for (; follow.next_pix < horizon; follow.next_pix += window) {
+                double due = track->mip_map_idx_to_time(follow.next_pix, pix_per_s) - state->play_position;
+                send_follow_window(client, track, follow.next_pix, follow.next_pix + window,
+                                   std::max(due, 0.0));
+            }
         }
     }
 
-    void send_cursor() {
-        info("sending cursor message to remote");
+    // one window of playback follow: /follow [start, end, pps, due_ms], 
+    // where due_ms is how long until the playhead gets to start,
+    // then the pixels, like /pixels but sent to /pixels_follow
+    void send_follow_window(shared_ptr<osc_client_t> client, shared_ptr<haptic_track_t> track,
+                            int start, int end, double due) {
+        client_view_t view = client->view;
+        double pix_per_s = view.pps();
+
+        m_pool.enqueue([this, client, track, view, pix_per_s, start, end, due]() {
+            int channel = track->clamp_channel(view.channel);
+            audio_pixel_block_t audiopix_block = track->get_pixels(pix_per_s);
+            const auto& pixels = audiopix_block.get_pixels().at(channel);
+
+            // before the start or past the end of the track there's nothing to feel
+            int first = std::max(start, 0);
+            int last = std::min(end, (int)pixels.size());
+            if (last <= first)
+                return;
+
+            oscpkt::Message header("/follow");
+            header.pushInt32(first)
+                  .pushInt32(last)
+                  .pushFloat(pix_per_s)
+                  .pushFloat(due * 1000.0);
+            m_manager->send(header, client);
+
+            int interval_us = client->health.pacing_interval_us(view.chunk_interval_us);
+            for (const oscpkt::Message& msg : encode_pixels(pixels, first, last, view, "/pixels_follow")) {
+                m_manager->send(msg, client);
+                std::this_thread::sleep_for(std::chrono::microseconds(interval_us));
+            }
+        });
+        metrics().send_queue_depth.set(m_pool.queue_size());
+    }
+
+    // tell a client that a finer level is ready for its track,
+    // so it can re-request what it's looking at
+    void send_resolution(shared_ptr<osc_client_t> client, shared_ptr<haptic_track_t> track) {
+        if (!track->mipmap())
+            return;
+
+        auto [ready, total] = track->mipmap()->levels_ready();
+        json j = {
+            {"pps", track->mipmap()->best_pps()},
+            {"ready", ready},
+            {"levels", total},
+            {"source", to_string(track->source())}
+        };
+
+        oscpkt::Message msg("/resolution");
+        msg.pushStr(j.dump());
+        m_manager->send(msg, client);
+    }
+
+    // push deltas for every track that was rebuilt since the last tick
+    void send_pending_deltas(const vec<shared_ptr<osc_client_t>>& clients) {
+        std::set<shared_ptr<haptic_track_t>> changed, improved;
+        {
+            std::lock_guard<std::mutex> lock(m_changed_mutex);
+            changed.swap(m_changed_tracks);
+            improved.swap(m_improved_tracks);
+        }
+
+        for (auto& track : improved) {
+            for (auto& client : clients) {
+                if (track_for(client->view) == track)
+                    send_resolution(client, track);
+            }
+        }
+
+        for (auto& track : changed) {
+            for (auto& client : clients) {
+                if (track_for(client->view) == track)
+                    send_pixels_delta(client, track);
+            }
+        }
+    }
+
+    void send_cursor(shared_ptr<osc_client_t> client) {
+        info("sending cursor message to {}", client->addr());
 
         // TODO: make sure that the cursor is within the bounds of the mipmap 
         // before we send
+        shared_ptr<haptic_track_t> track = track_for(client->view);
+        if (!track)
+            return;
 
         oscpkt::Message msg("/cursor");
-        msg.pushStr(json(m_tracks.active()->get_cursor_mip_map_idx()).dump());
-        m_manager->send(msg);
+        msg.pushStr(json(track->get_cursor_mip_map_idx(client->view.pps())).dump());
+        m_manager->send(msg, client);
     }
     
     void set_mode(const std::string mode) {
@@ -138,68 +492,112 @@ public:
         }
     }
 
-    // TODO: un-
-    void send_peaks() {
-        if (!m_tracks.active()) {
-            info("no active track, can't send peaks");
-            return;
+    // the track a meter is looking at
+    MediaTrack* meter_track(int tracknum) {
+        if (tracknum == 0) {
+            auto track = m_tracks.active();
+            return track ? track->get_track() : nullptr;
         }
+        if (tracknum == -1)
+            return GetMasterTrack(project);
+        return GetTrack(project, tracknum - 1);
+    }
 
-        info("querying peak level from track {} and channel {}", 
-                (void*)m_tracks.active()->get_track(), 
-                m_tracks.active()->get_active_channel()
-        );
-        double level = Track_GetPeakInfo(m_tracks.active()->get_track(), 
-                                m_tracks.active()->get_active_channel());
-        info("sending peak level: {}", level);
+    void send_meter_layout(shared_ptr<osc_client_t> client) {
+        oscpkt::Message msg("/meter_layout");
+        msg.pushStr(m_meters.layout_json().dump());
+        m_manager->send(msg, client);
+    }
 
-        oscpkt::Message msg("/peak");
-        json j = level;
-        msg.pushStr(j.dump());
-        m_manager->send(msg);
+    // sample every meter, and send them all in one packet per client
+    void send_meters(const vec<shared_ptr<osc_client_t>>& clients) {
+        m_meters.tick([this](int tracknum) { return meter_track(tracknum); });
+
+        oscpkt::Message msg = m_meters.encode();
+        for (auto& client : clients)
+            m_manager->send(msg, client);
     }
 
-    bool get_connection_status() {
-        // resets the connection status
-        m_connection_status = false;
+    void send_stats(shared_ptr<osc_client_t> client) {
+        oscpkt::Message msg("/stats");
+        msg.pushStr(metrics().snapshot().dump());
+        m_manager->send(msg, client);
+    }
+
+    // periodically write the metrics to the resource path
+    void dump_stats() {
+        auto now = metric_clock_t::now();
+        if (now - m_last_stats_dump < std::chrono::milliseconds(STATS_DUMP_INTERVAL))
+            return;
+        m_last_stats_dump = now;
+
+        metrics().send_queue_depth.set(m_pool.queue_size());
+        m_pool.enqueue([]() {
+            metrics().dump(std::string(GetResourcePath()) + "/kiwi-stats.json");
+        });
+    }
+
+    // ping every client every HEARTBEAT_INTERVAL ms. the acks come back 
+    // through /ping_ack, which keeps each client's health up to date
+    void heartbeat() {
+        double now = time_precise();
+        if (now - m_last_heartbeat < HEARTBEAT_INTERVAL / 1000.0)
+            return;
+        m_last_heartbeat = now;
+
+        m_manager->prune(now);
+        for (auto& client : m_manager->clients()) {
+            client->health.expire(now);
 
-        oscpkt::Message msg("/ping");
-        m_manager->send(msg);
-        std::this_thread::sleep_for(std::chrono::milliseconds(TIMEOUT));
+            oscpkt::Message msg("/ping");
+            msg.pushInt32(client->health.ping_sent(now));
+            m_manager->send(msg, client);
+        }
+    }
 
-        return m_connection_status;
+    // true if any client answered a ping recently.
+    // doesn't wait on the network, the heartbeat keeps this fresh
+    bool get_connection_status() {
+        double now = time_precise();
+        bool connected = false;
+        for (auto& client : m_manager->clients()) {
+            info("client {}: {}", client->addr(), client->health.to_json(now).dump());
+            connected |= client->health.alive(now);
+        }
+        return connected;
     }
 
     // use this to register all callbacks with the osc manager
     void add_callbacks() {
         using Msg = oscpkt::Message;
+        using Client = shared_ptr<osc_client_t>;
 
         // add a callback to listen to
         m_manager->add_callback("/set_cursor",
-        [this](Msg& msg){
+        [this](Msg& msg, Client client){
             int index;
             if (msg.arg().popInt32(index)
                         .isOkNoMoreArgs()){
                 info("received /set_cursor to {}", index);
-                shared_ptr<haptic_track_t> active_track = m_tracks.active();
-                if (active_track)
-                    active_track->set_cursor(index);
+                shared_ptr<haptic_track_t> track = track_for(client->view);
+                if (track)
+                    track->set_cursor(index, client->view.pps());
             }
         });
 
         // send a single pixel, given a mip map idx
         m_manager->add_callback("/pixel",
-        [this](Msg& msg){
+        [this](Msg& msg, Client client){
             int index;
             if (msg.arg().popInt32(index)
                         .isOkNoMoreArgs()){
-                send_pixel(index);
+                send_pixel(client, index);
             }
         });
 
         // send a block of pixels, given a range of indices
         m_manager->add_callback("/pixels",
-        [this](Msg& msg){
+        [this](Msg& msg, Client client){
             std::string json_str;
             if (msg.arg().popStr(json_str)
                         .isOkNoMoreArgs()){
@@ -208,43 +606,222 @@ public:
                 int start = range.at(0).get<int>();
                 int end = range.at(1).get<int>();
 
-                send_pixels(start, end);
+                send_pixels(client, start, end);
             }
         });
 
+        // zooms the client's own view if it has one, 
+        // otherwise zooms REAPER's arrange view
         m_manager->add_callback("/zoom",
-        [this](Msg& msg){
+        [this](Msg& msg, Client client){
             float amt;
             if (msg.arg().popFloat(amt)
                         .isOkNoMoreArgs()){
-                info("received /zoom {} from remote controller", amt);
-                shared_ptr<haptic_track_t> active_track = m_tracks.active();
-                if (active_track)
-                    active_track->zoom((double)amt);
+                info("received /zoom {} from {}", amt, client->addr());
+                if (client->view.pix_per_s) {
+                    client->view.pix_per_s = client->view.pps() * amt;
+                } else {
+                    haptic_track_t::zoom((double)amt);
+                }
+            }
+        });
+
+        // pin the client to a resolution (pixels per second)
+        // 0 goes back to following REAPER's zoom
+        m_manager->add_callback("/set_zoom",
+        [this](Msg& msg, Client client){
+            float pix_per_s;
+            if (msg.arg().popFloat(pix_per_s)
+                        .isOkNoMoreArgs()){
+                info("received /set_zoom {} from {}", pix_per_s, client->addr());
+                if (pix_per_s > 0)
+                    client->view.pix_per_s = (double)pix_per_s;
+                else
+                    client->view.pix_per_s = std::nullopt;
+            }
+        });
+
+        // pin the client to a track number (1-based, -1 is master)
+        // 0 goes back to following REAPER's track selection
+        m_manager->add_callback("/set_track",
+        [this](Msg& msg, Client client){
+            int tracknum;
+            if (msg.arg().popInt32(tracknum)
+                        .isOkNoMoreArgs()){
+                info("received /set_track {} from {}", tracknum, client->addr());
+                client->view.track = tracknum;
+            }
+        });
+
+        m_manager->add_callback("/set_channel",
+        [this](Msg& msg, Client client){
+            int channel;
+            if (msg.arg().popInt32(channel)
+                        .isOkNoMoreArgs()){
+                info("received /set_channel {} from {}", channel, client->addr());
+                client->view.channel = std::max(channel, 0);
+            }
+        });
+
+        // pixels per packet, and microseconds between packets
+        m_manager->add_callback("/set_pacing",
+        [this](Msg& msg, Client client){
+            int chunk_size, interval_us;
+            if (msg.arg().popInt32(chunk_size)
+                         .popInt32(interval_us)
+                        .isOkNoMoreArgs()){
+                info("received /set_pacing {} {} from {}", chunk_size, interval_us, client->addr());
+                client->view.chunk_size = std::max(chunk_size, 1);
+                client->view.chunk_interval_us = std::max(interval_us, 0);
+            }
+        });
+
+        // how many pixels the client can display at once
+        m_manager->add_callback("/viewport",
+        [this](Msg& msg, Client client){
+            int width;
+            if (msg.arg().popInt32(width)
+                        .isOkNoMoreArgs()){
+                info("received /viewport {} from {}", width, client->addr());
+                client->view.viewport_width = std::max(width, 0);
+            }
+        });
+
+        // "json" or "quantized"
+        m_manager->add_callback("/set_format",
+        [this](Msg& msg, Client client){
+            std::string format;
+            if (msg.arg().popStr(format)
+                        .isOkNoMoreArgs()){
+                info("received /set_format {} from {}", format, client->addr());
+                if (format == "json") {
+                    client->view.format = pixel_format_t::json;
+                } else if (format == "quantized") {
+                    client->view.format = pixel_format_t::quantized;
+                } else {
+                    warn("invalid pixel format given: {}", format);
+                }
             }
         });
 
         m_manager->add_callback("/flush_map", 
-        [this](Msg& msg){
+        [this](Msg& msg, Client client){
             info("received /flush_map from remote controller");
-            shared_ptr<haptic_track_t> active_track = m_tracks.active();
+            shared_ptr<haptic_track_t> track = track_for(client->view);
             json j;
-            if (active_track)
-                active_track->mipmap()->flush();
+            if (track)
+                track->mipmap()->flush();
 
         });
 
+        // where to read audio from: "track" (after the FX) or "takes" 
+        // (before them, builds faster). with a track number (like /set_track)
+        // only that track changes, and "default" sends it back to the global one.
+        // clients hear about the source their track uses in /resolution
+        m_manager->add_callback("/set_source",
+        [this](Msg& msg, Client client){
+            std::string source_str;
+            int tracknum = 0;
+            auto args = msg.arg();
+            args.popStr(source_str);
+            bool per_track = args.nbArgRemaining() > 0;
+            if (per_track)
+                args.popInt32(tracknum);
+            if (!args.isOkNoMoreArgs())
+                return;
+
+            info("received /set_source {} {} from {}", source_str, tracknum, client->addr());
+            auto source = accessor_source_from_string(source_str);
+            if (!source && !(per_track && source_str == "default")) {
+                warn("invalid source given: {}", source_str);
+                return;
+            }
+
+            if (per_track) {
+                client_view_t view = client->view;
+                view.track = tracknum ? tracknum : view.track;
+                auto track = track_for(view);
+                if (!track)
+                    return;
+                track->set_source(source);
+                mark_dirty(track);
+            } else {
+                // only rebuild what people are looking at right away, the
+                // staleness check gets to the rest (suspects go first)
+                ACCESSOR_SOURCE = *source;
+                std::set<shared_ptr<haptic_track_t>> viewed;
+                for (auto& c : m_manager->clients()) {
+                    if (auto track = track_for(c->view))
+                        viewed.insert(track);
+                }
+                for (auto& track : m_tracks.all()) {
+                    if (!track->uses_global_source())
+                        continue;
+                    if (viewed.count(track))
+                        mark_dirty(track);
+                    else
+                        m_suspect_tracks.insert(track);
+                }
+            }
+
+            for (auto& c : m_manager->clients()) {
+                if (auto track = track_for(c->view))
+                    send_resolution(c, track);
+            }
+        });
+
+        // 1 to get pixels pushed ahead of the playhead during playback
+        // (see follow_playback), 0 to stop. optionally followed by how 
+        // far ahead to push, in ms (FOLLOW_LOOKAHEAD_MS otherwise)
+        m_manager->add_callback("/follow",
+        [this](Msg& msg, Client client){
+            int follow;
+            int lookahead_ms = 0;
+            auto args = msg.arg();
+            args.popInt32(follow);
+            if (args.nbArgRemaining())
+                args.popInt32(lookahead_ms);
+            if (args.isOkNoMoreArgs()){
+                info("received /follow {} {} from {}", follow, lookahead_ms, client->addr());
+                client->view.follow = follow != 0;
+                client->view.follow_lookahead_ms = std::max(lookahead_ms, 0);
+                client->follow.reset();
+            }
+        });
+
         m_manager->add_callback("/sync",
-        [this](Msg& msg){
+        [this](Msg& msg, Client client){
             info("received /sync from remote controller");
-            shared_ptr<haptic_track_t> active_track = m_tracks.active();
-            if (active_track) {
-                send_cursor();
+            send_cursor(client);
+        });
+
+        // which track channels to meter, as json: 
+        // [{"track": 1, "channel": 0}, ...] (track numbers like /set_track)
+        // everyone gets the new layout, since the meters are shared
+        m_manager->add_callback("/set_meters",
+        [this](Msg& msg, Client client){
+            std::string json_str;
+            if (msg.arg().popStr(json_str)
+                        .isOkNoMoreArgs()){
+                info("received /set_meters {} from {}", json_str, client->addr());
+                try {
+                    m_meters.set_meters(json::parse(json_str).get<vec<meter_id_t>>());
+                } catch (const json::exception& e) {
+                    warn("invalid meter list given: {}", e.what());
+                    return;
+                }
+                for (auto& c : m_manager->clients())
+                    send_meter_layout(c);
             }
         });
 
+        m_manager->add_callback("/meter_layout",
+        [this](Msg& msg, Client client){
+            send_meter_layout(client);
+        });
+
         m_manager->add_callback("/set_mode",
-        [this](Msg& msg){
+        [this](Msg& msg, Client client){
             std::string mode;
             if (msg.arg().popStr(mode)
                         .isOkNoMoreArgs()){
@@ -252,36 +829,91 @@ public:
             }
         });
         
+        m_manager->add_callback("/stats",
+        [this](Msg& msg, Client client){
+            info("received /stats from remote controller");
+            send_stats(client);
+        });
+
+        // acks echo the sequence number of the /ping (older clients don't)
         m_manager->add_callback("/ping_ack", 
-        [this](Msg& msg){
-            m_connection_status = true;
+        [this](Msg& msg, Client client){
+            int seq = -1;
+            auto args = msg.arg();
+            if (args.nbArgRemaining() && args.isInt32())
+                args.popInt32(seq);
+            client->health.ack_received(seq, time_precise());
+        });
+
+        // rtt, jitter and loss, as we see them
+        m_manager->add_callback("/health", 
+        [this](Msg& msg, Client client){
+            oscpkt::Message reply("/health");
+            reply.pushStr(client->health.to_json(time_precise()).dump());
+            m_manager->send(reply, client);
         });
 
         m_manager->add_callback("/ping", 
-        [this](Msg& msg){
-            info("received /ping from remote controller");
+        [this](Msg& msg, Client client){
+            info("received /ping from {}", client->addr());
             oscpkt::Message ackmsg("/ping_ack");
-            m_manager->send(ackmsg);
+            m_manager->send(ackmsg, client);
         });
     }
 
     // this runs about 30x per second. do all OSC polling here
     virtual void Run() override {
+        // everything below (and the workers) reads REAPER's state from here
+        project_state().refresh();
+
         // handle any packets
         m_manager->handle_receive(false);
+        heartbeat();
+        dump_stats();
+        drop_released_tracks();
 
-        auto active_track  = m_tracks.active();
-        if (!active_track) { return; }
+        auto clients = m_manager->clients();
         switch (m_mode) {
-            case controller_mode::mipmap:
-                // check for updates
-                if (active_track->mipmap()) {
-                    active_track->mipmap()->update(mipmap_update_closure_t(), false);
+            case controller_mode::mipmap: {
+                // check for updates on every track someone is looking at,
+                // and rebuild the ones we know have changed
+                std::set<shared_ptr<haptic_track_t>> tracks;
+                for (auto& client : clients) {
+                    if (auto track = track_for(client->view))
+                        tracks.insert(track);
                 }
+                check_stale_tracks(tracks);
+                tracks.insert(m_dirty_tracks.begin(), m_dirty_tracks.end());
+
+                for (auto& track : tracks) {
+                    // the closures run on the track's own workers, so they can't keep 
+                    // the track alive (it would end up destroying its own thread pool)
+                    std::weak_ptr<haptic_track_t> weak_track = track;
+                    track->update(false, [this, weak_track](haptic_track_t&) {
+                        std::lock_guard<std::mutex> lock(m_changed_mutex);
+                        if (auto track = weak_track.lock())
+                            m_changed_tracks.insert(track);
+                    }, [this, weak_track](haptic_track_t&, double) {
+                        std::lock_guard<std::mutex> lock(m_changed_mutex);
+                        if (auto track = weak_track.lock())
+                            m_improved_tracks.insert(track);
+                    });
+                }
+                send_pending_deltas(clients);
+                follow_playback(clients);
+
+                memory_budget().enforce();
+                accessor_pool().collect();
+
+                // dirty tracks are clean once their rebuild is out of the way
+                std::erase_if(m_dirty_tracks, [](const shared_ptr<haptic_track_t>& track) {
+                    return !track->rebuild_pending();
+                });
                 break;
+            }
 
             case controller_mode::meter:
-                send_peaks();
+                send_meters(clients);
                 break;
         }
     }
@@ -290,6 +922,25 @@ private:
     controller_mode m_mode {controller_mode::mipmap};
     shared_ptr<osc_manager_t> m_manager {nullptr};
     haptic_track_map_t m_tracks;
+    // deleted tracks that are ready to be dropped (see release_deleted_tracks).
+    // declared before the pool, so they outlive its workers
+    vec<shared_ptr<haptic_track_t>> m_released_tracks;
+    std::mutex m_released_mutex;
     ThreadPool m_pool { 4 };
-    std::atomic<bool> m_connection_status;
+    encoded_view_cache_t m_view_cache;
+    meter_engine_t m_meters;
+
+    // tracks rebuilt by a worker, waiting for their deltas to go out
+    std::mutex m_changed_mutex;
+    std::set<shared_ptr<haptic_track_t>> m_changed_tracks;
+    // tracks with newly published levels, waiting for a /resolution
+    std::set<shared_ptr<haptic_track_t>> m_improved_tracks;
+
+    // tracks that need a rebuild whether anyone's looking or not
+    std::set<shared_ptr<haptic_track_t>> m_dirty_tracks;
+    // tracks that might have changed, checked ahead of the round robin
+    std::set<shared_ptr<haptic_track_t>> m_suspect_tracks;
+    size_t m_stale_cursor {0};
+    metric_clock_t::time_point m_last_stats_dump {metric_clock_t::now()};
+    double m_last_heartbeat {0.0};
 };
\ No newline at end of file
@@ -9,10 +9,15 @@
 using std::unordered_map;
 using std::shared_ptr;
 
-// TODO: we're gonna need to figure out how to find out 
-// if a track has been destroyed, and, if so, how to 
-// clean up any haptic tracks associated with it. 
-// see: ValidatePtr2
+// how many interpolated blocks (one per resolution) a track keeps around.
+// each client browsing at its own zoom level needs one
+int MAX_CACHED_BLOCKS = 4;
+
+class haptic_track_t;
+using track_update_closure_t = std::function<void(haptic_track_t& track)>;
+using track_level_closure_t = std::function<void(haptic_track_t& track, double pix_per_s)>;
+
+// deleted tracks get cleaned up by haptic_track_map_t::prune
 class haptic_track_t {
 public: 
     haptic_track_t()
@@ -22,6 +27,10 @@ public:
        m_accessor(std::make_shared<audio_accessor_t>(track)) {
         setup();
     };
+
+    ~haptic_track_t() {
+        memory_budget().remove(this);
+    }
   
     void setup() {
         // debug("setting up haptic track with address {:p}", (void*)m_track);
@@ -40,49 +49,138 @@ public:
                 pix_per_s_res.push_back(pps_res);
         }
 
-        m_mipmap = std::make_shared<audio_pixel_mipmap_t>(m_accessor, pix_per_s_res);
-        m_mipmap->update([this] (audio_pixel_mipmap_t& map) {
-            this->update_active_block();
-        }, true);
-        m_active_channel = 0;
+        m_mipmap = std::make_shared<audio_pixel_mipmap_t>(m_accessor, pix_per_s_res,
+                                                          std::make_shared<peak_source_t>(m_track));
+
+        // let the memory budget take our finest levels when it needs to
+        std::weak_ptr<audio_pixel_mipmap_t> weak_mipmap = m_mipmap;
+        memory_budget().add(m_mipmap.get(), [weak_mipmap]() {
+            auto mipmap = weak_mipmap.lock();
+            return mipmap && mipmap->evict_finest_level();
+        });
+        // and our cache, which is cheaper to make again
+        memory_budget().add(this, {}, [this]() { clear_cached_blocks(); });
+        // the first build happens on the first call to update(), 
+        // so whoever asks for it gets to hear about every level
     } 
-    
-    void next_channel() {
-        m_active_channel = (m_active_channel + 1) % m_accessor->num_channels(); 
+
+    // rebuild the mipmap if the track's audio changed (or if it was never built)
+    // on_level is called from a worker thread as each mipmap level 
+    // becomes available, and on_update once the rebuild is done
+    void update(bool force = false, track_update_closure_t on_update = {}, 
+                track_level_closure_t on_level = {}) {
+        if (!m_mipmap)
+            return;
+
+        force = force || !m_built;
+        bool started = m_mipmap->update([this, on_update] (audio_pixel_mipmap_t& map) {
+            this->clear_cached_blocks();
+            if (on_update)
+                on_update(*this);
+        }, force, [this, on_level] (audio_pixel_mipmap_t& map, double pix_per_s) {
+            // our cached blocks were made from a coarser level
+            this->clear_cached_blocks();
+            if (on_level)
+                on_level(*this, pix_per_s);
+        });
+        m_built |= started;
     }
-    void prev_channel() {
-        m_active_channel = (m_active_channel - 1) % m_accessor->num_channels(); 
-    } 
-    int get_active_channel() {  
-        return m_active_channel; 
+
+    // the track's audio changed, rebuild on the next update()
+    void invalidate() {
+        if (m_mipmap)
+            m_mipmap->invalidate();
+    }
+
+    // where the track's audio gets read from (see accessor_source_t)
+    accessor_source_t source() const {
+        return m_accessor->source();
+    }
+
+    // pick a source for this track (nullopt follows ACCESSOR_SOURCE).
+    // the mipmap needs a rebuild after this
+    void set_source(std::optional<accessor_source_t> source) {
+        m_accessor->set_source(source);
+    }
+
+    // true if the track follows ACCESSOR_SOURCE
+    bool uses_global_source() const {
+        return m_accessor->uses_global_source();
     }
 
-    // returns an audio pixel block 
-    // at the current resolution
-    audio_pixel_block_t& get_pixels() {
-        update_active_block();
-        return m_active_block;
+    // true if the track's audio (or where it's read from) changed since
+    // the mipmap was built (asks the accessor, call this from the main thread)
+    bool stale() const {
+        return m_accessor->source_changed() || m_accessor->state_changed();
     }
 
-    audio_pixel_t get_pixel(int mip_map_index) {
-        update_active_block();
-        return m_active_block.get_pixels().at(m_active_channel).at(mip_map_index);
+    // waits for a running build, and stops taking new ones (see
+    // audio_pixel_mipmap_t::stop). for tracks on their way out
+    void stop() {
+        if (m_mipmap)
+            m_mipmap->stop();
     }
 
-    void set_cursor(int mip_map_idx) {
-        double t = mip_map_idx / GetHZoomLevel() + m_accessor->get_time_bounds().first;
+    // true if a rebuild is waiting or running
+    bool rebuild_pending() {
+        return m_mipmap && m_mipmap->rebuilding();
+    }
+
+    int num_channels() const {
+        return m_accessor->num_channels();
+    }
+
+    // keeps a channel index within the track's channels
+    int clamp_channel(int channel) const {
+        return std::clamp(channel, 0, std::max(num_channels() - 1, 0));
+    }
+
+    // the mipmap generation our pixels come from
+    uint64_t generation() const {
+        return m_mipmap ? m_mipmap->generation() : 0;
+    }
+
+    // returns an audio pixel block at the given resolution
+    // the block shares its pixels with our cache, so this is cheap
+    audio_pixel_block_t get_pixels(double pix_per_s) {
+        return get_cached_block(pix_per_s);
+    }
+
+    // at most num_pix pixels covering the pixel indices start to end at the
+    // given resolution (see audio_pixel_mipmap_t::get_pixels_lod)
+    audio_pixel_block_t get_pixels_lod(int start, int end, double pix_per_s, int num_pix) {
+        if (!m_mipmap)
+            return audio_pixel_block_t();
+        return m_mipmap->get_pixels_lod(start / pix_per_s, end / pix_per_s, num_pix);
+    }
+
+    audio_pixel_t get_pixel(int mip_map_index, int channel, double pix_per_s) {
+        return get_cached_block(pix_per_s).get_pixels().at(channel).at(mip_map_index);
+    }
+
+    void set_cursor(int mip_map_idx, double pix_per_s) {
+        double t = mip_map_idx_to_time(mip_map_idx, pix_per_s);
         // debug("setting cursor to mipmap  l;index {}, at time {}", mip_map_idx, t);
         SetEditCurPos(t, true, true);
     }
 
-    int get_cursor_mip_map_idx() {
-        double t0 = m_accessor->get_time_bounds().first;
-        double t = GetCursorPosition() - t0;
-        int mip_map_idx = floor(t * GetHZoomLevel());
+    int get_cursor_mip_map_idx(double pix_per_s) {
+        int mip_map_idx = time_to_mip_map_idx(project_state().get()->cursor, pix_per_s);
         // debug("getting cursor position, returning mipmap index {}", mip_map_idx);
         return mip_map_idx;
     }
 
+    // where a mipmap index is, in project time
+    double mip_map_idx_to_time(int mip_map_idx, double pix_per_s) const {
+        return mip_map_idx / pix_per_s + m_accessor->get_time_bounds().first;
+    }
+
+    // the mipmap index of a point in project time
+    int time_to_mip_map_idx(double t, double pix_per_s) const {
+        double t0 = m_accessor->get_time_bounds().first;
+        return floor((t - t0) * pix_per_s);
+    }
+
     static void zoom(double amt) {
         debug("zooming by {}", amt);
         adjustZoom(GetHZoomLevel() * amt, 1, true, -1);
@@ -106,39 +204,85 @@ public:
         return m_mipmap; 
     }
 
+    // drops the interpolated blocks we made for readers (see get_cached_block)
+    void clear_cached_blocks() {
+        std::lock_guard<std::mutex> lock(m_cache_mutex);
+        m_cached_blocks.clear();
+        report_cache();
+    }
+
 private:
     // asks the mipmap for an interpolated block of pixels
-    // use this to update the internal active block
-    audio_pixel_block_t calculate_pixels() {
+    audio_pixel_block_t calculate_pixels(double pix_per_s) {
         // debug("getting pixels for track {:p}", (void*)m_track);
         if (!m_mipmap) {
             // debug("no mipmap for track {:p}", (void*)m_track);
             return audio_pixel_block_t();
         }
-        double pix_per_s = GetHZoomLevel();
 
         return m_mipmap->get_pixels(std::nullopt, std::nullopt, pix_per_s);
     }
 
-    // updates the active block, if necessary
-    void update_active_block() {
-        double pix_per_s = GetHZoomLevel();
+    // finds the block at the given resolution in our cache,
+    // calculating it (and evicting the least recently used block) if needed
+    audio_pixel_block_t get_cached_block(double pix_per_s) {
+        memory_budget().touch(this);
+        {
+            std::lock_guard<std::mutex> lock(m_cache_mutex);
+            // drop everything if the mipmap was rebuilt since we cached
+            if (generation() != m_cached_generation) {
+                m_cached_blocks.clear();
+                m_cached_generation = generation();
+                report_cache();
+            }
 
-        if (pix_per_s != m_active_block.get_pps()) {
-            m_active_block = this->calculate_pixels();
+            auto it = std::find_if(m_cached_blocks.begin(), m_cached_blocks.end(),
+                                   [pix_per_s](auto& block) { return block.get_pps() == pix_per_s; });
+            if (it != m_cached_blocks.end()) {
+                metrics().cache_hits.add();
+                // move to the front, so it's the last to be evicted
+                std::rotate(m_cached_blocks.begin(), it, it + 1);
+                return m_cached_blocks.front();
+            }
         }
+
+        // calculate outside of the lock, since this can take a while
+        metrics().cache_misses.add();
+        audio_pixel_block_t block = calculate_pixels(pix_per_s);
+
+        std::lock_guard<std::mutex> lock(m_cache_mutex);
+        m_cached_blocks.insert(m_cached_blocks.begin(), block);
+        if (m_cached_blocks.size() > MAX_CACHED_BLOCKS)
+            m_cached_blocks.resize(MAX_CACHED_BLOCKS);
+        report_cache();
+        return block;
     }
 
-private:
-    int m_active_channel {0};
+    // tells the memory budget how big our cache is (hold m_cache_mutex)
+    void report_cache() {
+        size_t bytes = 0;
+        for (const audio_pixel_block_t& block : m_cached_blocks)
+            bytes += block.size_bytes();
+        memory_budget().set_cache(this, bytes);
+    }
 
     MediaTrack* m_track {nullptr};
-    audio_pixel_block_t m_active_block;
+
+    // most recently used first
+    vec<audio_pixel_block_t> m_cached_blocks;
+    uint64_t m_cached_generation {0};
+
+    // whether the mipmap has been (or is being) built
+    bool m_built {false};
+    std::mutex m_cache_mutex;
     shared_ptr<audio_pixel_mipmap_t> m_mipmap {nullptr};
     shared_ptr<audio_accessor_t> m_accessor {nullptr};
 };
 
-// a map to hold one haptic track per MediaTrack
+// a map to hold one haptic track per MediaTrack.
+// tracks are keyed by their GUID, so moving tracks around (which changes
+// their numbers) doesn't lose or mix up their mipmaps
+// only use this from the main thread
 class haptic_track_map_t {
 public:
 
@@ -148,43 +292,89 @@ public:
     }
 
     shared_ptr<haptic_track_t> active() { 
-        // TODO: check that the track we're returning actually 
-        // still exists
-        // debug("returning active haptic track with index: {}", active_track);
-        if (tracks.size() == 0) {
+        auto it = tracks.find(active_track);
+        return it == tracks.end() ? nullptr : it->second;
+    };
+
+    // every track we know about
+    vec<shared_ptr<haptic_track_t>> all() const {
+        vec<shared_ptr<haptic_track_t>> out;
+        for (auto& [guid, track] : tracks)
+            out.push_back(track);
+        return out;
+    }
+
+    // finds a track we already know about (doesn't add it)
+    shared_ptr<haptic_track_t> find(MediaTrack* track) const {
+        if (!track)
+            return nullptr;
+        auto it = tracks.find(guid(track));
+        return it == tracks.end() ? nullptr : it->second;
+    }
+
+    // finds a track by its number, adding it if it's new
+    //  track number 1-based, 0=not found, -1=master track
+    shared_ptr<haptic_track_t> get(int tracknum) {
+        MediaTrack* track = tracknum == -1 ? GetMasterTrack(project)
+                                           : GetTrack(project, tracknum - 1);
+        if (!track) {
+            debug("no track with number {}", tracknum);
             return nullptr;
-        } else {
-            return tracks.at(active_track); 
         }
-    };
+
+        add(track);
+        return find(track);
+    }
 
     void add(MediaTrack* track) {
-        // debug("adding haptic track with address {:p}", (void*)track);
-        int tracknum = haptic_track_t::get_track_number(track);
-        if (tracknum == 0) 
-            track = nullptr;
-            
-            // only add if it's new
-            if (tracks.find(tracknum) == tracks.end()) {
-            debug("track is new. adding!");
-            tracks[tracknum] = std::make_shared<haptic_track_t>(track);
-
-            active_track = tracknum;
+        if (!track)
+            return;
+
+        // only add if it's new
+        std::string key = guid(track);
+        if (tracks.find(key) == tracks.end()) {
+            debug("track {} is new. adding!", key);
+            tracks[key] = std::make_shared<haptic_track_t>(track);
         } else {
             debug("track is already in the map. not adding!");
         }
     }
 
     void active(MediaTrack* track) {
-        int tracknum = haptic_track_t::get_track_number(track);
-        if (!(tracks.find(tracknum) == tracks.end())) {
-            active_track = tracknum;
+        std::string key = track ? guid(track) : "";
+        if (tracks.find(key) != tracks.end()) {
+            active_track = key;
         } else {
             debug("track not found in track map");
         }
     }
 
+    // drops the tracks that were deleted from the project, along with their 
+    // mipmaps, accessors and threads (once nobody else holds on to them).
+    // returns the dropped tracks
+    vec<shared_ptr<haptic_track_t>> prune() {
+        vec<shared_ptr<haptic_track_t>> removed;
+        for (auto it = tracks.begin(); it != tracks.end();) {
+            if (ValidatePtr2(project, it->second->get_track(), "MediaTrack*")) {
+                ++it;
+                continue;
+            }
+
+            info("track {} was deleted, releasing it", it->first);
+            removed.push_back(it->second);
+            it = tracks.erase(it);
+        }
+        return removed;
+    }
+
+    // a track's GUID, as a string
+    static std::string guid(MediaTrack* track) {
+        char buf[64] = {0};
+        guidToString(GetTrackGUID(track), buf);
+        return buf;
+    }
+
 private:
-    unordered_map<int, shared_ptr<haptic_track_t>> tracks;
-    int active_track {-1}; // master
+    unordered_map<std::string, shared_ptr<haptic_track_t>> tracks;
+    std::string active_track {""};
 };
@@ -117,6 +117,7 @@ extern "C" REAPER_PLUGIN_DLL_EXPORT int REAPER_PLUGIN_ENTRYPOINT(
   REG_FUNC(AudioAccessorValidateState, rec);
   REG_FUNC(AudioAccessorUpdate, rec);
   REG_FUNC(CreateTrackAudioAccessor, rec);
+  REG_FUNC(CreateTakeAudioAccessor, rec);
   REG_FUNC(CSurf_OnZoom, rec);
   REG_FUNC(DestroyAudioAccessor, rec);
   REG_FUNC(EnumProjects, rec);
@@ -155,9 +156,22 @@ extern "C" REAPER_PLUGIN_DLL_EXPORT int REAPER_PLUGIN_ENTRYPOINT(
   REG_FUNC(GetAudioAccessorHash, rec);
   REG_FUNC(AudioAccessorValidateState, rec);
 
+  REG_FUNC(CountTrackMediaItems, rec);
+  REG_FUNC(GetTrackMediaItem, rec);
+  REG_FUNC(GetMediaItemTakeInfo_Value, rec);
+  REG_FUNC(TrackFX_GetCount, rec);
+  REG_FUNC(TakeFX_GetCount, rec);
+  REG_FUNC(GetTrackNumSends, rec);
+
   REG_FUNC(ValidatePtr2, rec);
+  REG_FUNC(GetTrackGUID, rec);
+  REG_FUNC(guidToString, rec);
   REG_FUNC(GetUserInputs, rec);
   REG_FUNC(Track_GetPeakInfo, rec);
+  REG_FUNC(time_precise, rec);
+  REG_FUNC(GetPlayState, rec);
+  REG_FUNC(GetPlayPosition, rec);
+  REG_FUNC(CountTracks, rec);
 
   // create log file
   std::string resource_path = GetResourcePath();
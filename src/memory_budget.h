@@ -0,0 +1,187 @@
+#pragma once
+
+#include "metrics.h"
+#include "log.h"
+
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+
+// how much memory all the mipmap levels together can use (MB)
+int MEMORY_BUDGET_MB = 512;
+
+// keeps track of how much memory every mipmap level uses, across all
+// tracks, along with what's derived from them (caches, and the working
+// copies of recording tracks). when we're over budget, the least recently
+// used owners drop their caches first, then give up their finest levels
+// (the biggest ones) until we're back under.
+// owners rebuild what they gave up when someone needs it again.
+// thread safe
+class memory_budget_t {
+public:
+    using owner_id = const void*;
+    // drops the owner's finest level. returns false if it can't
+    // (it must never call back into us while we hold the lock, so
+    // evictions run outside of it)
+    using evict_closure_t = std::function<bool()>;
+    // drops the owner's cache (same rules as evict_closure_t)
+    using drop_closure_t = std::function<void()>;
+
+    void add(owner_id owner, evict_closure_t evict, drop_closure_t drop_cache = {}) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_owners[owner].evict = evict;
+        m_owners[owner].drop_cache = drop_cache;
+        m_owners[owner].last_used = ++m_clock;
+    }
+
+    // forget about an owner, and everything it holds
+    void remove(owner_id owner) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_owners.find(owner);
+        if (it == m_owners.end())
+            return;
+        for (auto& [pps, bytes] : it->second.levels)
+            m_used -= bytes;
+        m_used -= it->second.cache + it->second.working;
+        m_owners.erase(it);
+        metrics().mipmap_bytes.set(m_used);
+    }
+
+    // how many bytes one of an owner's levels holds (0 if it's gone)
+    void set_level(owner_id owner, double pix_per_s, size_t bytes) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_owners.find(owner);
+        if (it == m_owners.end())
+            return;
+
+        auto& levels = it->second.levels;
+        m_used -= levels[pix_per_s];
+        m_used += bytes;
+        if (bytes == 0)
+            levels.erase(pix_per_s);
+        else
+            levels[pix_per_s] = bytes;
+        metrics().mipmap_bytes.set(m_used);
+    }
+
+    // how many bytes an owner's cache holds. the cache can go whenever
+    // we need the room (see add)
+    void set_cache(owner_id owner, size_t bytes) {
+        set_extra(owner, &owner_t::cache, bytes);
+    }
+
+    // how many bytes an owner holds that it needs to keep (for now)
+    void set_working(owner_id owner, size_t bytes) {
+        set_extra(owner, &owner_t::working, bytes);
+    }
+
+    // an owner was just read from
+    void touch(owner_id owner) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_owners.find(owner);
+        if (it != m_owners.end())
+            it->second.last_used = ++m_clock;
+    }
+
+    size_t used() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_used;
+    }
+
+    // drop caches, then evict levels, until we're under budget.
+    // call this every once in a while
+    void enforce() {
+        size_t budget = (size_t)MEMORY_BUDGET_MB << 20;
+        std::set<owner_id> exhausted;
+
+        // caches are cheap to make again, so they go first
+        while (true) {
+            drop_closure_t drop;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (m_used <= budget)
+                    return;
+
+                uint64_t oldest = UINT64_MAX;
+                owner_id victim {nullptr};
+                for (auto& [owner, entry] : m_owners) {
+                    if (entry.cache > 0 && entry.drop_cache && !exhausted.count(owner)
+                        && entry.last_used < oldest) {
+                        oldest = entry.last_used;
+                        victim = owner;
+                        drop = entry.drop_cache;
+                    }
+                }
+                if (!victim)
+                    break;
+                exhausted.insert(victim);
+            }
+            drop();
+        }
+        exhausted.clear();
+
+        while (true) {
+            owner_id victim {nullptr};
+            evict_closure_t evict;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (m_used <= budget)
+                    return;
+
+                // least recently used first, and everyone keeps their coarsest level
+                uint64_t oldest = UINT64_MAX;
+                for (auto& [owner, entry] : m_owners) {
+                    if (entry.levels.size() > 1 && !exhausted.count(owner)
+                        && entry.last_used < oldest) {
+                        oldest = entry.last_used;
+                        victim = owner;
+                        evict = entry.evict;
+                    }
+                }
+                if (!victim) {
+                    debug("memory budget: using {} bytes, but there's nothing left to evict", m_used);
+                    return;
+                }
+            }
+
+            if (evict && evict())
+                metrics().levels_evicted.add();
+            else
+                exhausted.insert(victim);
+        }
+    }
+
+private:
+    struct owner_t {
+        evict_closure_t evict;
+        drop_closure_t drop_cache;
+        std::map<double, size_t> levels; // pixels per second -> bytes
+        size_t cache {0};
+        size_t working {0};
+        uint64_t last_used {0};
+    };
+
+    void set_extra(owner_id owner, size_t owner_t::* field, size_t bytes) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_owners.find(owner);
+        if (it == m_owners.end())
+            return;
+
+        m_used -= it->second.*field;
+        m_used += bytes;
+        it->second.*field = bytes;
+        metrics().mipmap_bytes.set(m_used);
+    }
+
+    std::mutex m_mutex;
+    std::map<owner_id, owner_t> m_owners;
+    size_t m_used {0};
+    uint64_t m_clock {0}; // bumped on every touch, for LRU
+};
+
+// the process-wide memory budget
+memory_budget_t& memory_budget() {
+    static memory_budget_t budget;
+    return budget;
+}
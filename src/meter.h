@@ -0,0 +1,146 @@
+#pragma once
+
+#include "include/oscpkt/oscpkt.hh"
+
+#include "reaper_plugin_functions.h"
+#include "pixel.h"
+#include "project_state.h"
+#include "log.h"
+
+#include <cmath>
+#include <functional>
+
+// how many ticks of history each meter keeps
+int METER_HISTORY = 32;
+// how long a peak is held before it starts to fall (ms)
+int METER_HOLD_MS = 500;
+// how fast a held peak falls once the hold is over (dB per second)
+double METER_DECAY_DB_PER_S = 20.0;
+// the quietest level we send. everything below is sent as 0
+double METER_FLOOR_DB = -60.0;
+
+// a single thing to meter: a track channel.
+// tracks are numbered like client_view_t: 1-based, -1 is the master,
+// and 0 is whatever track is selected
+struct meter_id_t {
+    int track {0};
+    int channel {0};
+
+    NLOHMANN_DEFINE_TYPE_INTRUSIVE(meter_id_t, track, channel);
+};
+
+// the recent peaks of a single meter, and its hold envelope
+// peaks are linear amplitudes (like Track_GetPeakInfo)
+class meter_t {
+public:
+    meter_t(meter_id_t id)
+      : m_id(id), m_history(std::max(METER_HISTORY, 1), 0.0f) {}
+
+    // record a new peak, dt seconds after the last one
+    void push(float peak, double dt) {
+        m_head = (m_head + 1) % m_history.size();
+        m_history[m_head] = peak;
+
+        // the loudest peak within the hold window holds,
+        // and once it falls out of the window the hold decays
+        int hold_ticks = dt > 0 ? (int)ceil(METER_HOLD_MS / 1000.0 / dt) : 1;
+        hold_ticks = std::clamp(hold_ticks, 1, (int)m_history.size());
+
+        float held = 0.0f;
+        for (int i = 0; i < hold_ticks; i++)
+            held = std::max(held, m_history[(m_head + m_history.size() - i) % m_history.size()]);
+
+        float decay = (float)pow(10.0, -METER_DECAY_DB_PER_S * dt / 20.0);
+        m_hold = std::max(held, m_hold * decay);
+    }
+
+    const meter_id_t& id() const { return m_id; }
+    float peak() const { return m_history[m_head]; }
+    float hold() const { return m_hold; }
+
+private:
+    meter_id_t m_id;
+    vec<float> m_history;   // ring buffer of peaks
+    size_t m_head {0};      // the latest peak
+    float m_hold {0.0f};
+};
+
+// samples a set of meters every tick, and packs all of them into a
+// single message, so metering lots of tracks costs one packet per tick.
+// /meters [layout, tick, blob] where the blob holds two bytes per meter
+// (peak, then hold), in layout order, scaled from METER_FLOOR_DB (0)
+// to 0 dB (255). layout changes whenever the set of meters does,
+// see layout_json().
+// only use this from the main thread
+class meter_engine_t {
+public:
+    // resolves a meter's track number to a track (or nullptr)
+    using track_resolver_t = std::function<MediaTrack*(int tracknum)>;
+
+    meter_engine_t() { set_meters({meter_id_t()}); }
+
+    void set_meters(const vec<meter_id_t>& ids) {
+        m_meters.clear();
+        for (const meter_id_t& id : ids)
+            m_meters.emplace_back(id);
+        m_layout++;
+        info("meters: metering {} channels (layout {})", m_meters.size(), m_layout);
+    }
+
+    // sample every meter
+    void tick(const track_resolver_t& resolve) {
+        auto state = project_state().get();
+        double now = time_precise();
+        double dt = m_last_tick > 0 ? now - m_last_tick : 0.0;
+        m_last_tick = now;
+        m_tick++;
+
+        for (meter_t& meter : m_meters) {
+            MediaTrack* track = resolve(meter.id().track);
+            int num_channels = track ? state->num_channels(track) : 0;
+            float peak = 0.0f;
+            if (track && meter.id().channel < num_channels)
+                peak = (float)Track_GetPeakInfo(track, meter.id().channel);
+            meter.push(peak, dt);
+        }
+    }
+
+    // the latest tick, all meters in one message
+    oscpkt::Message encode() const {
+        vec<uint8_t> values;
+        values.reserve(m_meters.size() * 2);
+        for (const meter_t& meter : m_meters) {
+            values.push_back(to_byte(meter.peak()));
+            values.push_back(to_byte(meter.hold()));
+        }
+
+        oscpkt::Message msg("/meters");
+        msg.pushInt32(m_layout)
+           .pushInt32(m_tick)
+           .pushBlob(values.data(), values.size());
+        return msg;
+    }
+
+    // what's in the /meters blob, and in which order
+    json layout_json() const {
+        json meters = json::array();
+        for (const meter_t& meter : m_meters)
+            meters.push_back(meter.id());
+        return {{"layout", m_layout}, {"meters", meters}};
+    }
+
+private:
+    // linear amplitude to a byte on a dB scale
+    static uint8_t to_byte(float amp) {
+        if (amp <= 0.0f)
+            return 0;
+        double db = 20.0 * log10(amp);
+        double scaled = (db - METER_FLOOR_DB) / -METER_FLOOR_DB;
+        return (uint8_t)std::clamp(scaled * 255.0 + 0.5, 0.0, 255.0);
+    }
+
+    vec<meter_t> m_meters;
+    int m_layout {0};
+    int m_tick {0};
+    double m_last_tick {0.0};
+};
@@ -0,0 +1,265 @@
+#pragma once
+
+#include "pixel.h"
+#include "log.h"
+
+#include <atomic>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+
+// runtime metrics for the plugin.
+// everything in here is safe to bump from any thread: counters
+// and histograms are plain atomics, so recording is cheap enough
+// to do in the hot paths (accessor reads, osc sends, etc)
+
+using metric_clock_t = std::chrono::steady_clock;
+
+// a monotonically increasing count of events
+class metric_counter_t {
+public:
+    void add(uint64_t amt = 1) { m_value.fetch_add(amt, std::memory_order_relaxed); }
+    uint64_t get() const { return m_value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> m_value {0};
+};
+
+// the last value of something we sample (like a queue depth),
+// along with the highest value we've ever seen
+class metric_gauge_t {
+public:
+    void set(int64_t value) {
+        m_value.store(value, std::memory_order_relaxed);
+        int64_t prev = m_max.load(std::memory_order_relaxed);
+        while (value > prev && !m_max.compare_exchange_weak(prev, value)) {}
+    }
+
+    int64_t get() const { return m_value.load(std::memory_order_relaxed); }
+    int64_t max() const { return m_max.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<int64_t> m_value {0};
+    std::atomic<int64_t> m_max {0};
+};
+
+// a histogram with power-of-two buckets
+// bucket i holds values in [2^(i-1), 2^i), so percentiles
+// are only accurate up to a factor of 2 (plenty for timings)
+class metric_histogram_t {
+public:
+    static constexpr int num_buckets = 40;
+
+    void record(uint64_t value) {
+        int bucket = std::min((int)std::bit_width(value), num_buckets - 1);
+        m_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        m_count.fetch_add(1, std::memory_order_relaxed);
+        m_sum.fetch_add(value, std::memory_order_relaxed);
+
+        uint64_t prev = m_max.load(std::memory_order_relaxed);
+        while (value > prev && !m_max.compare_exchange_weak(prev, value)) {}
+    }
+
+    uint64_t count() const { return m_count.load(std::memory_order_relaxed); }
+
+    // upper bound of the bucket containing the given percentile (0 to 1)
+    uint64_t percentile(double p) const {
+        uint64_t total = count();
+        if (total == 0)
+            return 0;
+
+        uint64_t target = std::max<uint64_t>(1, (uint64_t)ceil(p * total));
+        uint64_t seen = 0;
+        for (int i = 0; i < num_buckets; i++) {
+            seen += m_buckets[i].load(std::memory_order_relaxed);
+            if (seen >= target)
+                return i == 0 ? 0 : (1ull << i) - 1;
+        }
+        return m_max.load(std::memory_order_relaxed);
+    }
+
+    json snapshot() const {
+        uint64_t n = count();
+        uint64_t sum = m_sum.load(std::memory_order_relaxed);
+        return {
+            {"n", n},
+            {"mean", n ? sum / n : 0},
+            {"p50", percentile(0.5)},
+            {"p99", percentile(0.99)},
+            {"max", m_max.load(std::memory_order_relaxed)}
+        };
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, num_buckets> m_buckets {};
+    std::atomic<uint64_t> m_count {0};
+    std::atomic<uint64_t> m_sum {0};
+    std::atomic<uint64_t> m_max {0};
+};
+
+// measures the time between construction and destruction,
+// and records it (in microseconds) into one or more histograms
+class metric_timer_t {
+public:
+    metric_timer_t(metric_histogram_t& hist, metric_histogram_t* also = nullptr)
+        : m_hist(hist), m_also(also), m_start(metric_clock_t::now()) {}
+
+    ~metric_timer_t() {
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+            metric_clock_t::now() - m_start
+        ).count();
+        m_hist.record(elapsed);
+        if (m_also)
+            m_also->record(elapsed);
+    }
+
+private:
+    metric_histogram_t& m_hist;
+    metric_histogram_t* m_also {nullptr};
+    metric_clock_t::time_point m_start;
+};
+
+// all the metrics we collect
+class metrics_t {
+public:
+    // mipmap builds
+    metric_counter_t mipmap_builds;
+    metric_histogram_t mipmap_build_us;
+    // appends to a recording track (see audio_pixel_mipmap_t::append)
+    metric_counter_t mipmap_appends;
+    metric_histogram_t mipmap_append_us;
+
+    // build duration for a single mipmap level, keyed by
+    // the level's resolution (in pixels per second)
+    metric_histogram_t& level_build_us(double pix_per_s) {
+        std::lock_guard<std::mutex> lock(m_levels_mutex);
+        // std::map never moves its nodes, so handing out a ref is fine
+        return m_level_build_us[std::to_string(pix_per_s)];
+    }
+
+    // accessor
+    metric_counter_t accessor_samples_read;
+    metric_gauge_t live_accessors;
+    metric_counter_t accessors_opened;
+    metric_counter_t accessors_closed;
+
+    // reaper's peak files (see peak_source_t)
+    metric_counter_t mipmap_peak_builds;
+    metric_counter_t mipmap_previews;
+    metric_counter_t peaks_missing;
+    metric_counter_t peak_samples_read;
+
+    // memory held by every mipmap level (see memory_budget_t)
+    metric_gauge_t mipmap_bytes;
+    metric_counter_t levels_evicted;
+
+    // worker queues (tasks waiting for a thread)
+    metric_gauge_t mipmap_queue_depth;
+    metric_gauge_t send_queue_depth;
+
+    // osc traffic
+    metric_counter_t osc_packets_in;
+    metric_counter_t osc_packets_out;
+    metric_counter_t osc_bytes_out;
+    metric_counter_t osc_dropped_sends;
+
+    // the haptic tracks' interpolated block cache
+    metric_counter_t cache_hits;
+    metric_counter_t cache_misses;
+
+    // encoded views shared between clients
+    metric_counter_t view_cache_hits;
+    metric_counter_t view_cache_misses;
+
+    // a compact snapshot of everything
+    json snapshot() {
+        uint64_t hits = cache_hits.get();
+        uint64_t lookups = hits + cache_misses.get();
+        uint64_t view_hits = view_cache_hits.get();
+        uint64_t view_lookups = view_hits + view_cache_misses.get();
+
+        json levels = json::object();
+        {
+            std::lock_guard<std::mutex> lock(m_levels_mutex);
+            for (auto& [pps, hist] : m_level_build_us)
+                levels[pps] = hist.snapshot();
+        }
+
+        return {
+            {"uptime_s", std::chrono::duration_cast<std::chrono::seconds>(
+                            metric_clock_t::now() - m_start).count()},
+            {"mipmap", {
+                {"builds", mipmap_builds.get()},
+                {"build_us", mipmap_build_us.snapshot()},
+                {"appends", mipmap_appends.get()},
+                {"append_us", mipmap_append_us.snapshot()},
+                {"level_build_us", levels}
+            }},
+            {"accessor", {
+                {"samples_read", accessor_samples_read.get()},
+                {"live", live_accessors.get()},
+                {"live_max", live_accessors.max()},
+                {"opened", accessors_opened.get()},
+                {"closed", accessors_closed.get()}
+            }},
+            {"peaks", {
+                {"builds", mipmap_peak_builds.get()},
+                {"previews", mipmap_previews.get()},
+                {"missing", peaks_missing.get()},
+                {"samples_read", peak_samples_read.get()}
+            }},
+            {"memory", {
+                {"mipmap_bytes", mipmap_bytes.get()},
+                {"mipmap_bytes_max", mipmap_bytes.max()},
+                {"levels_evicted", levels_evicted.get()}
+            }},
+            {"pool", {
+                {"mipmap_queue_depth", mipmap_queue_depth.get()},
+                {"mipmap_queue_depth_max", mipmap_queue_depth.max()},
+                {"send_queue_depth", send_queue_depth.get()},
+                {"send_queue_depth_max", send_queue_depth.max()}
+            }},
+            {"osc", {
+                {"packets_in", osc_packets_in.get()},
+                {"packets_out", osc_packets_out.get()},
+                {"bytes_out", osc_bytes_out.get()},
+                {"dropped_sends", osc_dropped_sends.get()}
+            }},
+            {"cache", {
+                {"hits", hits},
+                {"misses", lookups - hits},
+                {"hit_rate", lookups ? (double)hits / lookups : 0.0},
+                {"view_hits", view_hits},
+                {"view_misses", view_lookups - view_hits},
+                {"view_hit_rate", view_lookups ? (double)view_hits / view_lookups : 0.0}
+            }}
+        };
+    }
+
+    // write a snapshot to a file
+    bool dump(const std::string& path) {
+        std::ofstream ofs(path);
+        if (!ofs.is_open()) {
+            warn("metrics: could not open {} for writing", path);
+            return false;
+        }
+        ofs << std::setw(4) << snapshot() << std::endl;
+        return true;
+    }
+
+private:
+    metric_clock_t::time_point m_start {metric_clock_t::now()};
+
+    std::mutex m_levels_mutex;
+    std::map<std::string, metric_histogram_t> m_level_build_us;
+};
+
+// the process-wide metrics registry
+metrics_t& metrics() {
+    static metrics_t registry;
+    return registry;
+}
@@ -2,7 +2,13 @@
 
 #include "pixel_block.h"
 #include "accessor.h"
-#include <shared_mutex>
+#include "peaks.h"
+#include "metrics.h"
+#include "scheduler.h"
+#include "memory_budget.h"
+
+#include <atomic>
+#include <memory>
 
 #include "include/ThreadPool/ThreadPool.h"
 
@@ -13,40 +19,128 @@
 // hold audio_pixel_block_t at different resolutions
 // and is able to interpolate between them to 
 // get audio pixels at any resolution inbetween
-// thread safe (will block if another thread is updating)
+// each level is published as soon as it's done, so readers can use
+// whatever is ready without waiting for the whole rebuild. peak file
+// builds go coarse first. accessor builds reduce the finest level (the
+// slow part, with a coarse preview from the peaks up front if there's
+// one) and merge the coarser ones from it right after.
+// thread safe, and readers never block: the levels live in an immutable
+// snapshot, and rebuilds swap in a new snapshot when a level is done
+
+// the published state of a mipmap. never modified once published.
+// levels are stored as they were reduced, and normalized (by their
+// scales) on the way out, so a diff only finds the pixels that changed.
+// blocks share their pixels with the previous snapshot, so making 
+// a new snapshot with one level replaced is cheap
+struct mipmap_snapshot_t {
+    // the levels that are ready, keyed by pixels per second
+    std::map<double, audio_pixel_block_t, std::greater<double>> blocks;
+    // sorted resolutions of the ready levels
+    vec<double> ready_pps;
+    // what each level gets normalized by (see audio_pixel_transform_t)
+    std::map<double, vec<channel_scale_t>> scales;
+    // spans that changed the last time each level was built
+    std::map<double, vec<pixel_span_t>> changes;
+    // bumped every time a level is published
+    uint64_t generation {0};
+
+    bool empty() const { return ready_pps.empty(); }
+
+    // finds the lower bound of the ready resolutions
+    // (there must be at least one level ready)
+    double nearest_pps(double pix_per_s) const {
+        auto const it = std::lower_bound(ready_pps.begin(), ready_pps.end(), pix_per_s);
+        if (it == ready_pps.end())
+            return ready_pps.back();
+        
+        return *it;
+    }
+};
+
+// what a build leaves behind so the next one can pick up where it left
+// off while the track is recording (see audio_pixel_mipmap_t::append).
+// only the build touches this, and there's only one build at a time
+struct mipmap_growth_t {
+    bool valid {false};
+    double t0 {0.0};
+    double t1 {0.0};
+    int num_channels {0};
+    int sample_rate {0};
+    // the levels as they were reduced (uncompressed), keyed by pixels per
+    // second. appends only touch their tails, and publish just the tails
+    std::map<double, audio_pixel_block_t> levels;
+};
 
 class audio_pixel_mipmap_t;
 using mipmap_update_closure_t = std::function<void(audio_pixel_mipmap_t& map)>;
+// called every time a level is published, with the level's resolution
+using mipmap_level_closure_t = std::function<void(audio_pixel_mipmap_t& map, double pix_per_s)>;
 
 class audio_pixel_mipmap_t {
 public:
-    audio_pixel_mipmap_t(shared_ptr<audio_accessor_t> accessor, vec<double> resolutions)
-    :m_accessor(accessor) {
+    audio_pixel_mipmap_t(shared_ptr<audio_accessor_t> accessor, vec<double> resolutions,
+                         shared_ptr<peak_source_t> peaks = nullptr)
+    :m_accessor(accessor), m_peaks(peaks) {
         info("creating audio pixel mipmap");
 
         for (double res : resolutions) {
             if (res > 0)
-                m_blocks[res] = audio_pixel_block_t(res);
+                m_block_pps.push_back(res);
         }
-        m_block_pps = resolutions;
         std::sort(m_block_pps.begin(), m_block_pps.end());
     }
 
+    ~audio_pixel_mipmap_t() {
+        // wait for any running build while the rest of us is still alive
+        m_pool.reset();
+        memory_budget().remove(this);
+    }
+
+    // waits for any running build, and shuts the workers down, so the
+    // destructor doesn't have to. blocks, so keep it off the main thread,
+    // and don't update() afterwards
+    void stop() {
+        m_pool.reset();
+    }
+
     // returns a copy of the block at the specified resolution
+    // (resampled from the best level that's ready, empty if none are)
     audio_pixel_block_t get_pixels(opt<double> t0, opt<double> t1, 
                                   double pix_per_s){
-        std::lock_guard<std::mutex> lock(m_mutex);
+        auto snap = snapshot();
         debug("mipmap: getting pixels for range {} to {} with resolution {}", t0.value_or(0), t1.value_or(-1), pix_per_s);
 
-        int nearest_pps = get_nearest_pps(pix_per_s);
+        if (snap->empty())
+            return audio_pixel_block_t(pix_per_s);
+        used(*snap, pix_per_s);
+
+        double nearest_pps = snap->nearest_pps(pix_per_s);
 
         // bail early if we already have the given pps
         if (nearest_pps == pix_per_s){
-            return m_blocks.at(nearest_pps).get_pixels(t0, t1).clone();
+            return normalized(*snap, nearest_pps, t0, t1);
         }
 
-        // perform interpolation
-        return m_blocks.at(nearest_pps).get_pixels(t0, t1).interpolate(pix_per_s);
+        // resample from the nearest finer level. since we're mostly going down
+        // in resolution, this merges pixels and keeps all the peaks
+        return normalized(*snap, nearest_pps, t0, t1).interpolate(pix_per_s);
+    }
+
+    // returns at most num_pix pixels covering the time range t0 to t1 
+    // (in seconds from the start of the track). 
+    // uses the cheapest level that has at least num_pix pixels in the range,
+    // so the work is bounded by num_pix, not by how far we're zoomed in
+    audio_pixel_block_t get_pixels_lod(double t0, double t1, int num_pix) {
+        auto snap = snapshot();
+        if (snap->empty() || t1 <= t0 || num_pix <= 0)
+            return audio_pixel_block_t();
+
+        double density = num_pix / (t1 - t0);
+        used(*snap, density);
+        double level_pps = snap->nearest_pps(density);
+        debug("mipmap: lod for {} pixels from {} to {} uses level {}", num_pix, t0, t1, level_pps);
+
+        return normalized(*snap, level_pps, t0, t1).decimate(num_pix);
     }
 
     // flush contents to file
@@ -67,51 +161,133 @@ public:
     }
 
     void to_json(json& j) {
-        std::lock_guard<std::mutex> lock(m_mutex);
+        auto snap = snapshot();
 
-        for (auto& map_entry : m_blocks) {
-            j[std::to_string(map_entry.first)] = map_entry.second.get_pixels();
+        for (auto& map_entry : snap->blocks) {
+            normalized(*snap, map_entry.first, std::nullopt, std::nullopt)
+                .to_json(j[std::to_string(map_entry.first)]);
         }
     }
     
 
     // update contents of the mipmap 
     // (if the audio accessor state has changed)
-    // if there is a worker thread already updating, then
-    // this function will do nothing. 
-    bool update(mipmap_update_closure_t on_update, bool force = false){
-        if (m_busy)
-            return false; // already updating. 
+    // call this every tick: changes are debounced, and if a rebuild is 
+    // already running, exactly one more runs after it (see rebuild_scheduler_t)
+    // while an armed track records, changes skip the debounce and only
+    // the new audio at the end gets read (see append).
+    // on_level is called (from the worker) as each level is published,
+    // and on_update once they're all done.
+    // returns true if a rebuild was started
+    bool update(mipmap_update_closure_t on_update, bool force = false,
+                mipmap_level_closure_t on_level = {}){
+        // armed tracks keep their levels around after a build, 
+        // so they can be appended to once recording starts
+        bool armed = m_accessor->record_armed();
+        bool growing = armed && !force && project_state().get()->recording();
+
+        // every change pushes the debounce back. the accessor keeps saying
+        // it changed until it's updated, so unless a build is reading from
+        // it, we catch it up right away, and the next edit is a new change.
+        // while a build runs, it stays changed, and the follow up's debounce
+        // counts from the last tick we saw that
+        auto state = m_scheduler.state();
+        bool building = state == rebuild_state_t::building
+                     || state == rebuild_state_t::building_dirty;
+        if (force) {
+            m_scheduler.request(true);
+        } else if (state == rebuild_state_t::idle && m_accessor->source_changed()) {
+            info("mipmap: accessor source changed");
+            m_scheduler.request();
+        } else if (m_accessor->state_changed()) {
+            debug("mipmap: accessor state changed");
+            if (!building)
+                m_accessor->catch_up();
+            m_scheduler.request(growing);
+        }
+
+        if (m_scheduler.try_start()) {
+            // keeps the accessor open until the build is done
+            auto lease = m_accessor->lease();
+            // if the track plays its items untouched, REAPER's peak files
+            // already have what we need, and we can skip decoding entirely
+            // (decided here, since it looks at the items)
+            bool pre_fx = m_accessor->source() == accessor_source_t::takes;
+            opt<vec<peak_item_t>> peak_items;
+            if (!armed && m_peaks)
+                peak_items = m_peaks->plan(pre_fx);
+            bool from_peaks = peak_items.has_value();
+            // reading the whole track through the accessor takes a while. if
+            // there's nothing to show yet, and the items are untouched (only
+            // the track's FX are in the way), their peaks make a rough preview
+            opt<vec<peak_item_t>> preview_items;
+            if (!from_peaks && !armed && m_peaks && snapshot()->empty())
+                preview_items = m_peaks->plan(true);
+
+            m_pool->enqueue([this, on_update, on_level, from_peaks, peak_items, preview_items, armed, growing, lease](){
+                m_accessor->update();
+                if (growing && append(*lease)) {
+                    m_scheduler.finish();
+                    if (on_update)
+                        on_update(*this);
+                    return;
+                }
 
-        if (m_accessor->state_changed() || force) {
-            info("mipmap: accessor state changed");
+                debug("mipmap: updating mipmap in worker thread (from peaks: {})", from_peaks);
+                metrics().mipmap_builds.add();
+                metric_timer_t build_timer(metrics().mipmap_build_us);
 
-            m_pool->enqueue([this, on_update](){
-                {
-                    debug("mipmap: updating mipmap in worker thread");
-                    m_busy = true;
+                // peak files that aren't all there yet leave it to the accessor
+                if (from_peaks && publish_peaks(*peak_items, on_level)) {
+                    metrics().mipmap_peak_builds.add();
+                    m_growth = {};
+                    report_growth();
+                } else {
+                    if (from_peaks)
+                        info("mipmap: peaks are missing, reading through the accessor instead");
+                    if (preview_items)
+                        publish_preview(*preview_items, on_level);
 
-                    auto buffer = std::make_shared<vec<double>>();
-                    m_accessor->update();
-                    m_accessor->get_samples(*buffer);
+                    // only the audio under the items gets read, 
+                    // the gaps between them turn into silent pixels
+                    vec<sample_segment_t> segments;
+                    m_accessor->get_samples(segments, *lease);
 
-                    std::lock_guard<std::mutex> lock(m_mutex);
+                    int num_channels = m_accessor->num_channels();
+                    int sample_rate = m_accessor->sample_rate();
+                    auto [t0, t1] = m_accessor->get_time_bounds();
                     
-                    // pass samples to update audio pixel blocks
-                    for (auto& it : m_blocks) {
-                        debug("updating block {}", it.first);
-                        it.second.update(*buffer, m_accessor->num_channels(), 
-                                                m_accessor->sample_rate());
-                        it.second.transform();
-                    };
+                    // the samples get reduced once (at the finest level), and the 
+                    // coarser levels are derived from it, which is cheap, and matches
+                    // reducing the samples again up to float rounding.
+                    // so the finest one is the slow one, and the rest follow right
+                    // after it. each goes out as soon as it's done
+                    std::map<double, audio_pixel_block_t> levels =
+                        reduce_levels(segments, num_channels, sample_rate, t0, t1,
+                                      [&](double pps, const audio_pixel_block_t& level) {
+                                          publish(pps, level);
+                                          if (on_level)
+                                              on_level(*this, pps);
+                                      });
                     debug("mipmap: finished updating mipmap in worker thread");
-                } // lock releases here
 
-                m_busy = false;
-                // make sure the lock is released before we call this, since 
-                // the caller may want to get a hold of the lock
-                on_update(*this);
+                    // the published levels share their pixels with these, and
+                    // appends write to them in place, so they get copies
+                    if (armed) {
+                        for (auto& [pps, level] : levels)
+                            level = level.clone();
+                        m_growth = {true, t0, t1, num_channels, sample_rate, std::move(levels)};
+                    } else {
+                        m_growth = {};
+                    }
+                    report_growth();
+                }
+
+                m_scheduler.finish();
+                if (on_update)
+                    on_update(*this);
             });
+            metrics().mipmap_queue_depth.set(m_pool->queue_size());
 
             return true;
         } else {
@@ -119,14 +295,319 @@ public:
         }
     }
 
+    // the audio changed (we heard about it some other way than the 
+    // accessor), so schedule a rebuild. the next update() picks it up
+    void invalidate() {
+        m_scheduler.request();
+    }
+
+    // true if a rebuild is waiting to start, or running
+    bool rebuilding() {
+        return m_scheduler.state() != rebuild_state_t::idle;
+    }
+
+    // drops the finest level that's ready (never the last one) to free
+    // up memory. it gets rebuilt the next time someone needs it.
+    // returns false if there was nothing to drop
+    bool evict_finest_level() {
+        double pix_per_s = 0.0;
+        {
+            std::lock_guard<std::mutex> lock(m_publish_mutex);
+            auto current = snapshot();
+            if (current->ready_pps.size() <= 1)
+                return false;
+
+            auto next = std::make_shared<mipmap_snapshot_t>(*current);
+            pix_per_s = next->ready_pps.back();
+            next->ready_pps.pop_back();
+            next->blocks.erase(pix_per_s);
+            next->scales.erase(pix_per_s);
+            next->changes.erase(pix_per_s);
+            next->generation++;
+            m_evicted = true;
+            std::atomic_store(&m_snapshot, shared_ptr<const mipmap_snapshot_t>(next));
+        }
+
+        memory_budget().set_level(this, pix_per_s, 0);
+        info("mipmap: evicted level {} to stay within the memory budget", pix_per_s);
+        return true;
+    }
+
+    // the pixel spans that changed during the last rebuild, 
+    // taken from the nearest cached resolution and scaled to the given one
+    vec<pixel_span_t> changed_spans(double pix_per_s) {
+        auto snap = snapshot();
+        vec<pixel_span_t> spans;
+        if (snap->empty())
+            return spans;
+
+        double nearest_pps = snap->nearest_pps(pix_per_s);
+        auto it = snap->changes.find(nearest_pps);
+        if (it == snap->changes.end())
+            return spans;
+
+        double ratio = pix_per_s / nearest_pps;
+        for (const pixel_span_t& span : it->second) {
+            spans.push_back({(int)floor(span.start * ratio), 
+                             (int)ceil(span.end * ratio)});
+        }
+        return spans;
+    }
+
+    // bumped every time a level is published, so callers can
+    // tell if something they derived from it is stale
+    uint64_t generation() const { return snapshot()->generation; }
+
+    // the finest resolution that's ready to use (0 if none are)
+    double best_pps() const {
+        auto snap = snapshot();
+        return snap->empty() ? 0.0 : snap->ready_pps.back();
+    }
+
+    // how many levels are ready, out of how many
+    pair<int, int> levels_ready() const {
+        return {(int)snapshot()->ready_pps.size(), (int)m_block_pps.size()};
+    }
+
+    // the current set of levels. hold on to this for as long as you
+    // need a consistent view: it won't change under you
+    shared_ptr<const mipmap_snapshot_t> snapshot() const {
+        return std::atomic_load(&m_snapshot);
+    }
+
 private:
-    // finds the lower bound of cached resolutions
-    double get_nearest_pps(double pix_per_s){
-        auto const it = std::lower_bound(m_block_pps.begin(), m_block_pps.end(), pix_per_s);
-        if (it == m_block_pps.end())
-            return m_block_pps.back();
-        
-        return *it;
+    // the working copies of a recording track's levels count against the
+    // memory budget too, even though they can't go while it records
+    void report_growth() {
+        size_t bytes = 0;
+        for (auto& [pps, level] : m_growth.levels)
+            bytes += level.size_bytes();
+        memory_budget().set_working(this, bytes);
+    }
+
+    // publishes every level from the items' peak files, coarsest first.
+    // returns false if some peaks were missing, in which case only
+    // the levels before that were published
+    bool publish_peaks(const vec<peak_item_t>& items, const mipmap_level_closure_t& on_level) {
+        auto [t0, t1] = m_accessor->update_time_bounds();
+        int num_channels = m_accessor->num_channels();
+        for (double pps : m_block_pps) {
+            metric_timer_t level_timer(metrics().level_build_us(pps));
+            auto pixels = peak_source_t::read(items, pps, num_channels, t0, t1);
+            if (!pixels)
+                return false;
+
+            audio_pixel_block_t block(pps);
+            block.update(std::move(*pixels));
+            publish(pps, block);
+            if (on_level)
+                on_level(*this, pps);
+        }
+        return true;
+    }
+
+    // publishes the coarsest level from the items' peak files,
+    // until the real thing is read (see update)
+    void publish_preview(const vec<peak_item_t>& items, const mipmap_level_closure_t& on_level) {
+        auto [t0, t1] = m_accessor->update_time_bounds();
+        double pps = m_block_pps.front();
+        auto pixels = peak_source_t::read(items, pps, m_accessor->num_channels(), t0, t1);
+        if (!pixels)
+            return;
+
+        metrics().mipmap_previews.add();
+        audio_pixel_block_t block(pps);
+        block.update(std::move(*pixels));
+        publish(pps, block);
+        debug("mipmap: published a preview at {} pps", pps);
+        if (on_level)
+            on_level(*this, pps);
+    }
+
+    // the track grew at the end (it's recording): reads only the audio 
+    // after what the last build saw, extends the finest level with it, and
+    // re-derives the tail of each coarser level from the next finer one.
+    // the appended spans get published as the levels' changes, and go out
+    // as deltas (no level is new, so on_level isn't called).
+    // returns false if the track changed some other way (or we have nothing
+    // to append to), in which case it needs a full rebuild
+    bool append(const accessor_lease_t& lease) {
+        auto [t0, t1] = m_accessor->update_time_bounds();
+        int num_channels = m_accessor->num_channels();
+        int sample_rate = m_accessor->sample_rate();
+        if (!m_growth.valid || t0 != m_growth.t0 || t1 < m_growth.t1
+            || num_channels != m_growth.num_channels || sample_rate != m_growth.sample_rate)
+            return false;
+
+        // the coarser levels have to line up with the finer ones
+        for (auto it = m_block_pps.rbegin(); it + 1 != m_block_pps.rend(); it++) {
+            int spp = m_growth.levels.at(*(it + 1)).samples_per_pixel(sample_rate);
+            int finer_spp = m_growth.levels.at(*it).samples_per_pixel(sample_rate);
+            if (spp % finer_spp != 0)
+                return false;
+        }
+
+        if (t1 == m_growth.t1)
+            return true;
+
+        metrics().mipmap_appends.add();
+        metric_timer_t append_timer(metrics().mipmap_append_us);
+
+        // the pixel the old end fell into was (probably) only partly 
+        // covered, so the read starts there
+        audio_pixel_block_t& finest = m_growth.levels.at(m_block_pps.back());
+        int spp = finest.samples_per_pixel(sample_rate);
+        int first_pix = (long long)((m_growth.t1 - t0) * sample_rate) / spp;
+
+        vec<sample_segment_t> segments;
+        if (!m_accessor->get_samples_from(segments, t0 + (double)first_pix * spp / sample_rate, lease))
+            return false;
+        debug("mipmap: appending {} to {} from pixel {}", m_growth.t1, t1, first_pix);
+
+        std::map<double, int> first_changed;
+        finest.extend(segments, num_channels, sample_rate, t0, t1, first_pix);
+        first_changed[m_block_pps.back()] = first_pix;
+        for (auto it = m_block_pps.rbegin(); it + 1 != m_block_pps.rend(); it++) {
+            const audio_pixel_block_t& finer = m_growth.levels.at(*it);
+            audio_pixel_block_t& block = m_growth.levels.at(*(it + 1));
+            int factor = block.samples_per_pixel(sample_rate) / finer.samples_per_pixel(sample_rate);
+            first_changed[*(it + 1)] = block.merge_tail(finer, factor, first_changed[*it]);
+        }
+        m_growth.t1 = t1;
+        report_growth();
+
+        // coarsest first, like a full build. the published levels take the
+        // new tails, and share everything before them (see with_tail)
+        auto current = snapshot();
+        for (double pps : m_block_pps) {
+            const audio_pixel_block_t& level = m_growth.levels.at(pps);
+            const auto& channels = level.get_pixels();
+            int first = first_changed[pps];
+            int num_pix = level.get_num_pix_per_channel();
+
+            // the scale is the old one, grown by the tail's peaks. it never
+            // shrinks while recording (the old peaks of a pixel we re-derived
+            // stay in it), which is close enough until the next full build.
+            // levels the memory budget evicted stay evicted until then
+            auto prev = current->blocks.find(pps);
+            if (prev == current->blocks.end()) {
+                m_evicted = true;
+                continue;
+            }
+
+            vec<channel_scale_t> scales = current->scales.at(pps);
+            scales.resize(channels.size());
+            for (int ch = 0; ch < channels.size(); ch++) {
+                scales[ch] = scales[ch].merge(audio_pixel_transform_t::measure(
+                                channels[ch].data() + first, num_pix - first));
+            }
+
+            // (a level that isn't compressed yet gets encoded whole, once)
+            publish(pps, prev->second.with_tail(level, first), pixel_span_t{first, num_pix}, scales);
+        }
+        return true;
+    }
+
+    // swaps in a new snapshot with a freshly built level (as it was
+    // reduced, not normalized), and remembers what changed. 
+    // only the worker calls this.
+    // levels that are new (or were evicted) have no changes: clients hear
+    // about them through /resolution and ask for what they need.
+    // if the scale moved, every pixel reads differently, so all of them
+    // changed. appends already know what else changed, come compressed
+    // (see with_tail), and bring their scale along, since measuring the
+    // whole level every time would cost O(pixels)
+    void publish(double pix_per_s, const audio_pixel_block_t& block,
+                 opt<pixel_span_t> appended = std::nullopt,
+                 opt<vec<channel_scale_t>> appended_scales = std::nullopt) {
+        std::lock_guard<std::mutex> lock(m_publish_mutex);
+        auto current = snapshot();
+        auto next = std::make_shared<mipmap_snapshot_t>(*current);
+
+        vec<channel_scale_t> scales = appended_scales ? *appended_scales : block.measure();
+        vec<pixel_span_t>& changes = next->changes[pix_per_s];
+        changes.clear();
+        auto prev = current->blocks.find(pix_per_s);
+        if (prev != current->blocks.end()) {
+            if (current->scales.at(pix_per_s) != scales)
+                changes.push_back({0, block.get_num_pix_per_channel()});
+            else if (appended)
+                changes.push_back(*appended);
+            else
+                changes = block.diff(prev->second);
+        }
+        next->scales[pix_per_s] = scales;
+
+        // levels are stored compressed, silence is mostly free
+        audio_pixel_block_t stored = block;
+        if (!appended)
+            stored.compress();
+        next->blocks[pix_per_s] = stored;
+        memory_budget().set_level(this, pix_per_s, stored.size_bytes());
+
+        auto it = std::lower_bound(next->ready_pps.begin(), next->ready_pps.end(), pix_per_s);
+        if (it == next->ready_pps.end() || *it != pix_per_s)
+            next->ready_pps.insert(it, pix_per_s);
+
+        next->generation++;
+        std::atomic_store(&m_snapshot, shared_ptr<const mipmap_snapshot_t>(next));
+        debug("mipmap: published level {} ({} of {} ready)", pix_per_s, 
+                next->ready_pps.size(), m_block_pps.size());
+    }
+
+    // a copy of the pixels of a ready level from t0 to t1, normalized
+    static audio_pixel_block_t normalized(const mipmap_snapshot_t& snap, double pix_per_s,
+                                          opt<double> t0, opt<double> t1) {
+        audio_pixel_block_t block = snap.blocks.at(pix_per_s).get_pixels(t0, t1).clone();
+        block.transform(snap.scales.at(pix_per_s));
+        return block;
+    }
+
+    // a reader wants pixels at pix_per_s. keeps us fresh in the memory 
+    // budget's eyes, and if the level it needs was evicted, rebuilds it
+    void used(const mipmap_snapshot_t& snap, double pix_per_s) {
+        memory_budget().touch(this);
+        if (!m_evicted)
+            return;
+
+        // the level we'd use if everything was there
+        auto it = std::lower_bound(m_block_pps.begin(), m_block_pps.end(), pix_per_s);
+        double wanted = it == m_block_pps.end() ? m_block_pps.back() : *it;
+        if (!std::binary_search(snap.ready_pps.begin(), snap.ready_pps.end(), wanted)
+            && m_evicted.exchange(false)) {
+            info("mipmap: level {} was evicted, rebuilding it", wanted);
+            m_scheduler.request(true);
+        }
+    }
+
+    // reduces the samples at the finest resolution, then derives each 
+    // coarser level from the next finer one (see merge_down). levels whose
+    // pixels don't line up with the finer level's get reduced from the samples.
+    // on_reduced gets each level as soon as it's done
+    std::map<double, audio_pixel_block_t> reduce_levels(const vec<sample_segment_t>& segments,
+                                                         int num_channels, int sample_rate,
+                                                         double t0, double t1,
+                                                         const std::function<void(double, const audio_pixel_block_t&)>& on_reduced) {
+        std::map<double, audio_pixel_block_t> levels;
+        const audio_pixel_block_t* finer = nullptr;
+        for (auto it = m_block_pps.rbegin(); it != m_block_pps.rend(); it++) {
+            double pps = *it;
+            metric_timer_t level_timer(metrics().level_build_us(pps));
+
+            audio_pixel_block_t block(pps);
+            int spp = block.samples_per_pixel(sample_rate);
+            int finer_spp = finer ? finer->samples_per_pixel(sample_rate) : 0;
+            if (finer && spp % finer_spp == 0) {
+                block = finer->merge_down(spp / finer_spp);
+            } else {
+                // we're one of the pool's threads, the others help 
+                // with the reduction (there's only one build at a time)
+                block.update(segments, num_channels, sample_rate, t0, t1, m_pool.get());
+            }
+            finer = &(levels[pps] = block);
+            on_reduced(pps, *finer);
+        }
+        return levels;
     }
 
     // create a new interpolated block from a source block
@@ -136,9 +617,15 @@ private:
     // where we get the samples from
     shared_ptr<audio_accessor_t> m_accessor {nullptr}; 
 
-    // the lo-res pixel blocks
-    // TODO: these shouldn't be doubles
-    std::map<double, audio_pixel_block_t, std::greater<double>> m_blocks;
+    // a faster way to get peaks, for tracks without FX
+    shared_ptr<peak_source_t> m_peaks {nullptr};
+
+    // the lo-res pixel blocks, and everything else readers look at
+    // only ever read and replaced through std::atomic_load/atomic_store
+    // TODO: the resolutions shouldn't be doubles
+    shared_ptr<const mipmap_snapshot_t> m_snapshot {
+        std::make_shared<const mipmap_snapshot_t>()
+    };
 
     // sorted list of the blocks pps
     vec<double> m_block_pps; 
@@ -151,6 +638,11 @@ private:
         )
     };
 
-    std::mutex m_mutex;
-    std::atomic<bool> m_busy {false};
+    rebuild_scheduler_t m_scheduler;
+    mipmap_growth_t m_growth;
+
+    // publish and evict both replace the snapshot, one at a time
+    std::mutex m_publish_mutex;
+    // some levels were dropped by the memory budget
+    std::atomic<bool> m_evicted {false};
 };
\ No newline at end of file
@@ -5,12 +5,16 @@
 #include <functional>
 #include <stdio.h>
 #include <map>
+#include <mutex>
 
+#include "client.h"
 #include "log.h"
+#include "metrics.h"
 
-// return true if you successfully handled the message
-// and popped all the arguments
-using OSCCallback = std::function<void(oscpkt::Message&)>;
+using std::shared_ptr;
+
+// called with the message and the client that sent it
+using OSCCallback = std::function<void(oscpkt::Message&, shared_ptr<osc_client_t>)>;
 
 class osc_manager_t {
   osc_manager_t();
@@ -20,10 +24,14 @@ public:
     : m_addr(addr), m_send_port(send_port), m_recv_port(recv_port) {}
 
   bool init() {
-    info("connecting to {}:{}", m_addr, m_send_port);
     info("binding to {}", m_recv_port);
-    m_init = m_send_sock.connectTo(m_addr, m_send_port) \
-              && m_recv_sock.bindTo(m_recv_port);
+    m_init = m_recv_sock.bindTo(m_recv_port);
+
+    // the address we were configured with is our first client.
+    // anyone else who talks to us gets added as they show up
+    if (m_init && !m_addr.empty())
+      m_init = get_client(m_addr)->connected();
+
     info("success: {}", (bool)m_init);
     return m_init;
   }
@@ -32,6 +40,13 @@ public:
     if (!m_init) {return;}
 
     if (m_recv_sock.receiveNextPacket(block ? -1 : 0)) {
+      metrics().osc_packets_in.add();
+
+      // figure out who sent this
+      std::string origin = m_recv_sock.packetOrigin().asString();
+      auto client = get_client(origin.substr(0, origin.rfind(':')));
+      client->health.heard_from(time_precise());
+
       // setup a reader
       oscpkt::PacketReader reader(m_recv_sock.packetData(), m_recv_sock.packetSize());
       oscpkt::Message *msg {nullptr};
@@ -42,18 +57,54 @@ public:
         for (const auto &pair : m_callbacks){
           // only call if pattern matches
           if (msg->match(pair.first).isOk())
-            pair.second(*msg);
+            pair.second(*msg, client);
         }
       }
     }
   }
 
-  bool send(const oscpkt::Message& msg) {
-    if (!m_init) {return false;}
+  bool send(const oscpkt::Message& msg, const shared_ptr<osc_client_t>& client) {
+    if (!m_init || !client) {return false;}
 
     oscpkt::PacketWriter writer;
     writer.init().addMessage(msg);
-    return m_send_sock.sendPacket(writer.packetData(), writer.packetSize());
+    bool sent = client->send_packet(writer.packetData(), writer.packetSize());
+
+    if (sent) {
+      metrics().osc_packets_out.add();
+      metrics().osc_bytes_out.add(writer.packetSize());
+    } else {
+      metrics().osc_dropped_sends.add();
+    }
+    return sent;
+  }
+
+  // send a message to every client we know about
+  void broadcast(const oscpkt::Message& msg) {
+    for (auto& client : clients())
+      send(msg, client);
+  }
+
+  // a copy of the current client list
+  std::vector<shared_ptr<osc_client_t>> clients() {
+    std::lock_guard<std::mutex> lock(m_clients_mutex);
+    std::vector<shared_ptr<osc_client_t>> out;
+    for (auto& [addr, client] : m_clients)
+      out.push_back(client);
+    return out;
+  }
+
+  // forget the clients we haven't heard from in CLIENT_TIMEOUT ms, 
+  // so stray senders don't get pinged (and metered) forever.
+  // they're added back if they talk to us again
+  void prune(double now) {
+    std::lock_guard<std::mutex> lock(m_clients_mutex);
+    std::erase_if(m_clients, [now](const auto& entry) {
+      if (entry.second->health.silent_for(now) < CLIENT_TIMEOUT / 1000.0)
+        return false;
+      info("forgetting client at {}, it's been quiet too long", entry.first);
+      return true;
+    });
   }
 
   void add_callback(std::string pattern, OSCCallback callback) {
@@ -61,13 +112,29 @@ public:
   }
 
 private:
+  // finds a client by ip address, adding it if it's new
+  shared_ptr<osc_client_t> get_client(const std::string& addr) {
+    std::lock_guard<std::mutex> lock(m_clients_mutex);
+    auto it = m_clients.find(addr);
+    if (it != m_clients.end())
+      return it->second;
+
+    info("new client at {}", addr);
+    auto client = std::make_shared<osc_client_t>(addr, m_send_port);
+    client->connect();
+    m_clients[addr] = client;
+    return client;
+  }
+
   std::map<std::string, OSCCallback> m_callbacks;
 
+  std::mutex m_clients_mutex;
+  std::map<std::string, shared_ptr<osc_client_t>> m_clients;
+
   std::string m_addr {"localhost"} ;
   int m_send_port {0};
   int m_recv_port {0};
   bool m_init {false};
 
-  oscpkt::UdpSocket m_send_sock;
   oscpkt::UdpSocket m_recv_sock;
 };
\ No newline at end of file
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "reaper_plugin_functions.h"
+#include "pixel.h"
+#include "metrics.h"
+#include "log.h"
+
+#include <numbers>
+#include <optional>
+
+// an unmuted item's active take, and where it plays (see peak_source_t::plan)
+struct peak_item_t {
+    MediaItem_Take* take {nullptr};
+    double pos {0.0};
+    double len {0.0};
+    int src_channels {1};
+};
+
+// reads min/max peaks for a track's items straight from REAPER's
+// peak files (.reapeaks) through GetMediaItemTake_Peaks.
+// that's way faster than rendering the track through an audio accessor,
+// but it only sees the items' source audio, so it's only usable on tracks
+// where the source audio is what the track plays (no FX, no gain/rate
+// changes, no fades, no offsets)
+class peak_source_t {
+public:
+    peak_source_t(MediaTrack* track)
+      : m_track(track) {};
+
+    // the items to read peaks from, or nullopt if the peaks wouldn't match
+    // what the track accessor gives us (or what the takes would, before
+    // the track's FX, if pre_fx).
+    // call this from the main thread, and hand the result to read()
+    std::optional<vec<peak_item_t>> plan(bool pre_fx = false) const {
+        if (!m_track || (!pre_fx && TrackFX_GetCount(m_track) > 0))
+            return std::nullopt;
+
+        vec<peak_item_t> items;
+        int num_items = CountTrackMediaItems(m_track);
+        for (int i = 0; i < num_items; i++) {
+            MediaItem* item = GetTrackMediaItem(m_track, i);
+            if (GetMediaItemInfo_Value(item, "B_MUTE") != 0)
+                continue;
+
+            MediaItem_Take* take = GetActiveTake(item);
+            PCM_source* source = take ? GetMediaItemTake_Source(take) : nullptr;
+            if (!source
+                || TakeFX_GetCount(take) > 0
+                || GetMediaItemInfo_Value(item, "D_VOL") != 1.0
+                || GetMediaItemTakeInfo_Value(take, "D_VOL") != 1.0
+                || GetMediaItemTakeInfo_Value(take, "D_PLAYRATE") != 1.0
+                || GetMediaItemTakeInfo_Value(take, "D_STARTOFFS") != 0.0
+                || GetMediaItemInfo_Value(item, "D_FADEINLEN") > 0.0
+                || GetMediaItemInfo_Value(item, "D_FADEOUTLEN") > 0.0
+                || GetMediaItemInfo_Value(item, "D_FADEINLEN_AUTO") > 0.0
+                || GetMediaItemInfo_Value(item, "D_FADEOUTLEN_AUTO") > 0.0)
+                return std::nullopt;
+
+            items.push_back({take,
+                             GetMediaItemInfo_Value(item, "D_POSITION"),
+                             GetMediaItemInfo_Value(item, "D_LENGTH"),
+                             std::max(GetMediaSourceNumChannels(source), 1)});
+        }
+        return items;
+    }
+
+    // reads peaks for the time range t0 to t1 (in project time)
+    // at the given resolution. pixel 0 is at t0.
+    // peak files only hold max and min, so rms is estimated from
+    // the peak to peak amplitude (as if the audio was a sine).
+    // returns nullopt if REAPER doesn't have all the peaks (yet), like
+    // right after an import, while it's still building the .reapeaks.
+    // only touches the takes' peak files, so it's fine on a worker thread
+    static std::optional<vec<vec<audio_pixel_t>>> read(const vec<peak_item_t>& items, double pix_per_s,
+                                                       int num_channels, double t0, double t1) {
+        int num_pix = ceil((t1 - t0) * pix_per_s) + 1;
+        vec<vec<audio_pixel_t>> pixels(num_channels, vec<audio_pixel_t>(num_pix, audio_pixel_t(0, 0, 0)));
+
+        vec<double> buffer;
+        for (size_t i = 0; i < items.size(); i++) {
+            auto [take, pos, len, src_channels] = items[i];
+            int first_pix = std::max((int)floor((pos - t0) * pix_per_s), 0);
+            int item_num_pix = std::min((int)ceil(len * pix_per_s), num_pix - first_pix);
+            if (item_num_pix <= 0)
+                continue;
+
+            // maxes for all channels come first, then the mins
+            buffer.resize(item_num_pix * src_channels * 2);
+            int result = GetMediaItemTake_Peaks(take, pix_per_s, t0 + first_pix / pix_per_s,
+                                                src_channels, item_num_pix, 0, buffer.data());
+            int num_read = result & 0xfffff;
+            debug("peaks: read {} of {} peaks for item {} at {} pps",
+                    num_read, item_num_pix, i, pix_per_s);
+            metrics().peak_samples_read.add(num_read * src_channels);
+            if (num_read < item_num_pix) {
+                metrics().peaks_missing.add();
+                return std::nullopt;
+            }
+
+            const double* maxes = buffer.data();
+            const double* mins = buffer.data() + item_num_pix * src_channels;
+            for (int ch = 0; ch < num_channels; ch++) {
+                // mono items play on every channel of the track
+                int src_ch = ch % src_channels;
+                audio_pixel_t* dst = pixels[ch].data() + first_pix;
+                for (int p = 0; p < num_read; p++) {
+                    float max = maxes[p * src_channels + src_ch];
+                    float min = mins[p * src_channels + src_ch];
+                    // overlapping items: keep the loudest
+                    float rms = (max - min) / (2 * std::numbers::sqrt2_v<float>);
+                    dst[p] = audio_pixel_t(std::max(dst[p].m_max, max),
+                                           std::min(dst[p].m_min, min),
+                                           std::max(dst[p].rms(), rms));
+                }
+            }
+        }
+        return pixels;
+    }
+
+private:
+    MediaTrack* m_track {nullptr};
+};
@@ -17,26 +17,42 @@ using json = nlohmann::json;
 // one sample of audio pixel data, which stores max, min, and rms values
 // avoid making these when the pixel-to-sample ratio is 1:1, since we can 
 // just store the raw sample value in that case
+// rms isn't stored directly: pixels keep the sum of squares and the
+// number of samples behind them, so they can be merged without going
+// back to the samples (the sum of squares is a float, so merges round a bit)
 class audio_pixel_t {
 public: 
     audio_pixel_t() {};
-    audio_pixel_t(double max, double min, double rms) : m_max(max), m_min(min), m_rms(rms) {};
+    audio_pixel_t(float max, float min, float rms, uint32_t count = 1) 
+        : m_max(max), m_min(min), m_sum_sq(rms * rms * count), m_count(count) {};
 
     // linearly interpolate between two pixels
     static audio_pixel_t linear_interpolation(double t, double t0, double t1, audio_pixel_t p0, audio_pixel_t p1){
-        audio_pixel_t p;
-        p.m_max = linear_interp(t, t0, t1, p0.m_max, p1.m_max);
-        p.m_min = linear_interp(t, t0, t1, p0.m_min, p1.m_min);
-        p.m_rms = linear_interp(t, t0, t1, p0.m_rms, p1.m_rms);
-        return p;
+        return audio_pixel_t(linear_interp(t, t0, t1, p0.m_max, p1.m_max),
+                             linear_interp(t, t0, t1, p0.m_min, p1.m_min),
+                             linear_interp(t, t0, t1, p0.rms(), p1.rms()));
     }
 
-    double m_max{ std::numeric_limits<double>::lowest() };
-    double m_min { std::numeric_limits<double>::max() };
-    double m_rms { 0 };
+    float rms() const { return m_count ? sqrt(m_sum_sq / m_count) : 0.0f; }
+
+    // scales the rms (and nothing else) by gain
+    void scale_rms(float gain) { m_sum_sq *= gain * gain; }
+
+    bool operator==(const audio_pixel_t& other) const = default;
+
+    // floats are plenty for haptics (the output gets quantized to a few
+    // bits anyway), and they halve the memory (and bandwidth) of every level
+    float m_max{ std::numeric_limits<float>::lowest() };
+    float m_min { std::numeric_limits<float>::max() };
+    // sum of the squared samples, and how many samples there were
+    float m_sum_sq { 0 };
+    uint32_t m_count { 0 };
 
 public:
-    NLOHMANN_DEFINE_TYPE_INTRUSIVE(audio_pixel_t, m_max, m_min, m_rms);
+    // rms gets finalized on the way out
+    friend void to_json(json& j, const audio_pixel_t& pixel) {
+        j = json{{"m_max", pixel.m_max}, {"m_min", pixel.m_min}, {"m_rms", pixel.rms()}};
+    }
 };
 
 // this is the pixel format that the iOS client expects
@@ -66,38 +82,116 @@ haptic_pixel_block_t from(const vec<audio_pixel_t>& pixels, int start, int end){
     return block;
 }
 
+// a run of quantized haptic pixels, for clients whose haptic engine
+// only resolves a handful of intensity levels. 
+// ids are implicit (start + i), and each value is an 8-bit fraction 
+// of scale, which is the peak intensity of the quantized range
+class haptic_quant_block_t {
+public:
+    int start { 0 };
+    float scale { 0 };
+    vec<uint8_t> values;
+
+    // a sub range of this block, with the same scale
+    haptic_quant_block_t slice(size_t first, size_t last) const {
+        haptic_quant_block_t out;
+        last = std::min(last, values.size());
+        first = std::min(first, last);
+        out.start = start + first;
+        out.scale = scale;
+        out.values.assign(values.begin() + first, values.begin() + last);
+        return out;
+    }
+};
+
+haptic_quant_block_t quantize(const vec<audio_pixel_t>& pixels, int start, int end){
+    haptic_quant_block_t block;
+    start = std::clamp(start, 0, (int)pixels.size());
+    end = std::clamp(end, start, (int)pixels.size());
+    int num_pix = end - start;
+
+    block.start = start;
+    block.values.resize(num_pix);
+
+    // these are all straight loops over contiguous arrays
+    // (no branches, no calls), so the compiler can vectorize them
+    const audio_pixel_t* src = pixels.data() + start;
+    vec<float> intensity(num_pix);
+    for (int i = 0; i < num_pix; i++) {
+        // same intensity as haptic_pixel_t
+        intensity[i] = (float)(std::abs(src[i].m_max) + std::abs(src[i].m_min) / 2);
+    }
+
+    float peak = 0.0f;
+    for (int i = 0; i < num_pix; i++) {
+        peak = std::max(peak, intensity[i]);
+    }
+    block.scale = peak;
+
+    float gain = peak > 0.0f ? 255.0f / peak : 0.0f;
+    uint8_t* dst = block.values.data();
+    for (int i = 0; i < num_pix; i++) {
+        dst[i] = (uint8_t)(intensity[i] * gain + 0.5f);
+    }
+    return block;
+}
+
+
+// the peaks a channel gets normalized by (see audio_pixel_transform_t)
+struct channel_scale_t {
+    float max { std::numeric_limits<float>::lowest() };
+    float min { std::numeric_limits<float>::max() };
+    float rms { 0.0f };
+
+    bool operator==(const channel_scale_t& other) const = default;
 
+    // the scale of this channel and another range of it, together
+    channel_scale_t merge(const channel_scale_t& other) const {
+        return {std::max(max, other.max), std::min(min, other.min), std::max(rms, other.rms)};
+    }
+};
+
+// normalizes blocks of pixels, every channel by its own peaks.
+// measuring and applying are separate, so pixels can be stored as they
+// were reduced, and normalized on the way out
 class audio_pixel_transform_t {
 public:
     audio_pixel_transform_t() {};
-    
-    void normalize(std::shared_ptr<vec<vec<audio_pixel_t>>> block){
-        std::vector<double> max_max_field;
-        std::vector<double> min_min_field;
-        std::vector<double> max_rms_field;
-
-        for (vec<audio_pixel_t>& curr_channel : (*block)) {
-            double channel_max_max = std::numeric_limits<double>::lowest();
-            double channel_max_min = std::numeric_limits<double>::max();
-            double channel_max_rms = std::numeric_limits<double>::lowest();
-
-            for (audio_pixel_t& curr_pixel : curr_channel) {
-                channel_max_max = std::max(channel_max_max, curr_pixel.m_max);
-                channel_max_min = std::min(channel_max_min, curr_pixel.m_min);
-                channel_max_rms = std::max(channel_max_max, curr_pixel.m_rms);
-            }
 
-            max_max_field.push_back(channel_max_max);
-            min_min_field.push_back(channel_max_min);
-            max_rms_field.push_back(channel_max_rms);
+    static channel_scale_t measure(const audio_pixel_t* pixels, size_t num_pix) {
+        channel_scale_t scale;
+        for (size_t i = 0; i < num_pix; i++) {
+            scale.max = std::max(scale.max, pixels[i].m_max);
+            scale.min = std::min(scale.min, pixels[i].m_min);
+            scale.rms = std::max(scale.rms, pixels[i].rms());
         }
+        return scale;
+    }
+
+    static vec<channel_scale_t> measure(const vec<vec<audio_pixel_t>>& block) {
+        vec<channel_scale_t> scales;
+        for (const vec<audio_pixel_t>& curr_channel : block)
+            scales.push_back(measure(curr_channel.data(), curr_channel.size()));
+        return scales;
+    }
 
-        for (int channel_idx = 0; channel_idx < block->size(); channel_idx++) {
-            for (audio_pixel_t& curr_pixel : block->at(channel_idx)) {
-                curr_pixel.m_max = curr_pixel.m_max/max_max_field.at(channel_idx);
-                curr_pixel.m_min = curr_pixel.m_min/min_min_field.at(channel_idx);
-                curr_pixel.m_rms = curr_pixel.m_rms/max_rms_field.at(channel_idx);
-            } 
+    // channels without a peak (silent ones) are left alone
+    static void apply(vec<vec<audio_pixel_t>>& block, const vec<channel_scale_t>& scales) {
+        auto gain = [](float peak) { return peak != 0.0f && std::isfinite(peak) ? 1.0f / peak : 1.0f; };
+        for (int channel_idx = 0; channel_idx < block.size() && channel_idx < scales.size(); channel_idx++) {
+            const channel_scale_t& scale = scales[channel_idx];
+            float max_gain = gain(scale.max);
+            float min_gain = gain(scale.min);
+            float rms_gain = gain(scale.rms);
+            for (audio_pixel_t& curr_pixel : block[channel_idx]) {
+                curr_pixel.m_max *= max_gain;
+                curr_pixel.m_min *= min_gain;
+                curr_pixel.scale_rms(rms_gain);
+            }
         }
     }
+
+    void normalize(std::shared_ptr<vec<vec<audio_pixel_t>>> block){
+        apply(*block, measure(*block));
+    }
 };
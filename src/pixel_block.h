@@ -1,7 +1,13 @@
 #pragma once
 
 #include "pixel.h"
+#include "pixel_runs.h"
 #include "log.h"
+#include "include/ThreadPool/ThreadPool.h"
+#include <cassert>
+#include <functional>
+#include <future>
+#include <optional>
 #include <vector> 
 
 template<typename T> 
@@ -12,6 +18,48 @@ using opt = std::optional<T>;
 
 using std::shared_ptr;
 
+// channels with fewer samples than this (per slice) aren't worth 
+// splitting up across threads (see audio_pixel_block_t::update)
+long long MIN_SLICE_SAMPLES = 1 << 20;
+
+// a range of pixel indices [start, end)
+struct pixel_span_t {
+    int start {0};
+    int end {0};
+
+    NLOHMANN_DEFINE_TYPE_INTRUSIVE(pixel_span_t, start, end);
+};
+
+// how a block gets resampled to a new resolution
+enum class resample_mode_t {
+    // linearly interpolate between the two nearest pixels
+    linear,
+    // when downsampling, merge every source pixel that overlaps a new pixel
+    // (max of maxes, min of mins, energy weighted rms), so transients between
+    // sample points don't get lost. when upsampling, interpolate linearly.
+    aggregate
+};
+
+// gives plain pixels the same interface as pixel_run_channel_t,
+// so aggregate can work on either
+struct dense_channel_t {
+    const vec<audio_pixel_t>& pixels;
+
+    audio_pixel_t at(int idx) const { return pixels[idx]; }
+
+    // plain reductions over a contiguous range, no branches
+    void reduce(int first, int last, float& max, float& min, 
+                double& sum_sq, double& count) const {
+        const audio_pixel_t* src = pixels.data();
+        for (int j = first; j < last; j++) {
+            max = std::max(max, src[j].m_max);
+            min = std::min(min, src[j].m_min);
+            sum_sq += src[j].m_sum_sq;
+            count += src[j].m_count;
+        }
+    }
+};
+
 // stores one block of mipmapped audio data, at a particular sample rate
 // should be able to update when the samples are updated
 // not thread safe by itself
@@ -22,7 +70,11 @@ public:
         :m_pix_per_s(pix_per_s) {};
     ~audio_pixel_block_t() {};
 
+    // a deep copy. compressed blocks come back expanded
     audio_pixel_block_t clone() const {
+        if (is_compressed())
+            return expand();
+
         audio_pixel_block_t block(*this);
         block.m_channel_pixels = std::make_shared<
                                     vec<vec<audio_pixel_t>>
@@ -31,7 +83,11 @@ public:
     }
 
     // returns a ref to the entire block of audio pixels
-    const vec<vec<audio_pixel_t>>& get_pixels() const { return *m_channel_pixels; };
+    // (the block can't be compressed, see compress)
+    const vec<vec<audio_pixel_t>>& get_pixels() const { 
+        assert(!is_compressed());
+        return *m_channel_pixels; 
+    };
 
     // returns a VIEW (not a copy) of pixels for the specified time range
     const audio_pixel_block_t get_pixels(opt<double> t0, opt<double> t1) const {
@@ -57,7 +113,16 @@ public:
         debug("retrieving {} pixels from {} to {}", end_idx - start_idx, start_idx, end_idx);
         debug("current resolution is {} pixels per second", m_pix_per_s);
 
-        const audio_pixel_block_t output_block(m_pix_per_s);
+        audio_pixel_block_t output_block(m_pix_per_s);
+
+        // views of compressed blocks stay compressed
+        if (is_compressed()) {
+            auto runs = std::make_shared<vec<pixel_run_channel_t>>();
+            for (const pixel_run_channel_t& channel : *m_channel_runs)
+                runs->push_back(channel.slice(start_idx, end_idx));
+            output_block.m_channel_runs = runs;
+            return output_block;
+        }
 
         for (int channel = 0; channel < m_channel_pixels->size(); channel++){
             output_block.m_channel_pixels->push_back(
@@ -69,8 +134,14 @@ public:
     }
 
 
-    // creates a new block at a new resolution, via linear interpolation
-    audio_pixel_block_t interpolate(double new_pps) const{
+    // creates a new block at a new resolution
+    audio_pixel_block_t interpolate(double new_pps, 
+                                    resample_mode_t mode = resample_mode_t::aggregate) const{
+        if (mode == resample_mode_t::aggregate && new_pps < m_pix_per_s)
+            return aggregate(new_pps);
+        if (is_compressed())
+            return expand().interpolate(new_pps, mode);
+
         debug("creating interpolated audio pixel block with resolution {}", new_pps);
 
         // TODO: handle optionals here
@@ -123,83 +194,484 @@ public:
         return new_block;
     }
 
+    // reduces the block to (at most) num_pix pixels per channel, 
+    // without losing any peaks (see aggregate)
+    audio_pixel_block_t decimate(int num_pix) const {
+        int src_num_pix = get_num_pix_per_channel();
+        if (num_pix <= 0 || src_num_pix <= num_pix)
+            return clone();
+
+        return aggregate(m_pix_per_s * num_pix / src_num_pix);
+    }
+
+    // creates a new, coarser block where each new pixel merges every one of 
+    // our pixels it overlaps: max of maxes, min of mins, and the rms of the 
+    // overlapping energy (weighted by how much of each pixel overlaps)
+    audio_pixel_block_t aggregate(double new_pps) const {
+        debug("creating aggregated audio pixel block with resolution {}", new_pps);
+        audio_pixel_block_t new_block(new_pps);
+
+        int src_num_pix = get_num_pix_per_channel();
+        if (src_num_pix == 0 || new_pps <= 0)
+            return new_block;
+
+        // how many of our pixels fit in a new one
+        double ratio = m_pix_per_s / new_pps;
+        int new_num_pix = std::max(1, (int)ceil(src_num_pix / ratio));
+
+        if (is_compressed()) {
+            // repeats (silence) are merged without looking at every pixel
+            for (const pixel_run_channel_t& channel : *m_channel_runs)
+                new_block.m_channel_pixels->push_back(
+                    aggregate_channel(channel, src_num_pix, ratio, new_num_pix));
+        } else {
+            for (auto& pix_channel : *m_channel_pixels)
+                new_block.m_channel_pixels->push_back(
+                    aggregate_channel(dense_channel_t{pix_channel}, src_num_pix, ratio, new_num_pix));
+        }
+        return new_block;
+    }
+
+    // creates a new, coarser block where each new pixel merges factor of
+    // our pixels (so it covers factor times as many samples). 
+    // pixels carry their sum of squares and sample count, so we get the
+    // same block as we would by reducing the samples again (give or take
+    // float rounding in the sums of squares)
+    audio_pixel_block_t merge_down(int factor) const {
+        audio_pixel_block_t new_block(m_pix_per_s / factor);
+        int src_num_pix = get_num_pix_per_channel();
+        if (src_num_pix == 0 || factor <= 0)
+            return new_block;
+
+        int new_num_pix = (src_num_pix + factor - 1) / factor;
+        auto merge_channel = [&](const auto& src) {
+            vec<audio_pixel_t> curr_pix_channel(new_num_pix);
+            merge_pixels(src, src_num_pix, factor, curr_pix_channel, 0);
+            return curr_pix_channel;
+        };
+
+        if (is_compressed()) {
+            for (const pixel_run_channel_t& channel : *m_channel_runs)
+                new_block.m_channel_pixels->push_back(merge_channel(channel));
+        } else {
+            for (auto& pix_channel : *m_channel_pixels)
+                new_block.m_channel_pixels->push_back(merge_channel(dense_channel_t{pix_channel}));
+        }
+        return new_block;
+    }
+
+    // like merge_down, but in place: grows the block to match finer 
+    // (which is factor times our resolution), and only re-derives our
+    // pixels from the one holding first_finer_pix on. the rest are kept.
+    // returns the index of the first pixel that was re-derived
+    int merge_tail(const audio_pixel_block_t& finer, int factor, int first_finer_pix) {
+        if (finer.is_compressed())
+            return merge_tail(finer.expand(), factor, first_finer_pix);
+
+        int src_num_pix = finer.get_num_pix_per_channel();
+        int new_num_pix = (src_num_pix + factor - 1) / factor;
+        int first = std::clamp(first_finer_pix / factor, 0, new_num_pix);
+        grow(finer.m_channel_pixels->size(), new_num_pix);
+        for (int channel = 0; channel < m_channel_pixels->size(); channel++) {
+            merge_pixels(dense_channel_t{finer.m_channel_pixels->at(channel)}, src_num_pix, 
+                         factor, m_channel_pixels->at(channel), first);
+        }
+        return first;
+    }
+
+    // a compressed copy of this block with the pixels from first on taken
+    // from src (an uncompressed block with the whole level in it). if
+    // we're compressed, everything before first is shared, so this costs
+    // O(new pixels), not O(pixels) (see pixel_run_channel_t::with_tail)
+    audio_pixel_block_t with_tail(const audio_pixel_block_t& src, int first) const {
+        assert(!src.is_compressed());
+        audio_pixel_block_t block(m_pix_per_s);
+        block.m_transform = m_transform;
+        auto runs = std::make_shared<vec<pixel_run_channel_t>>();
+        for (int channel = 0; channel < src.m_channel_pixels->size(); channel++) {
+            const vec<audio_pixel_t>& pixels = src.m_channel_pixels->at(channel);
+            if (is_compressed() && channel < m_channel_runs->size()) {
+                const pixel_run_channel_t& ours = m_channel_runs->at(channel);
+                int from = std::clamp(first, 0, std::min(ours.size(), (int)pixels.size()));
+                runs->push_back(ours.with_tail(from, pixels.data() + from, pixels.size() - from));
+            } else {
+                runs->push_back(pixel_run_channel_t::encode(pixels));
+            }
+        }
+        block.m_channel_runs = runs;
+        return block;
+    }
+
+    // finds the index spans where this block differs from another one
+    // (in any channel). spans closer than min_gap pixels are merged, 
+    // so a small edit doesn't turn into lots of tiny spans
+    vec<pixel_span_t> diff(const audio_pixel_block_t& other, int min_gap = 8) const {
+        if (is_compressed() || other.is_compressed())
+            return clone().diff(other.clone(), min_gap);
+
+        vec<pixel_span_t> spans;
+        if (m_channel_pixels->size() != other.m_channel_pixels->size()) {
+            // channel layout changed, so everything changed
+            spans.push_back({0, get_num_pix_per_channel()});
+            return spans;
+        }
+
+        int num_pix = std::max(get_num_pix_per_channel(), other.get_num_pix_per_channel());
+        auto changed = [&](int i) {
+            for (int ch = 0; ch < m_channel_pixels->size(); ch++) {
+                auto& ours = m_channel_pixels->at(ch);
+                auto& theirs = other.m_channel_pixels->at(ch);
+                if (i >= ours.size() || i >= theirs.size() || !(ours[i] == theirs[i]))
+                    return true;
+            }
+            return false;
+        };
+
+        for (int i = 0; i < num_pix; i++) {
+            if (!changed(i))
+                continue;
+
+            if (!spans.empty() && i - spans.back().end < min_gap)
+                spans.back().end = i + 1;
+            else
+                spans.push_back({i, i + 1});
+        }
+        return spans;
+    }
+
     // gets the resolution (in pixels per second)
     double get_pps() const { return m_pix_per_s; };
+
+    // how many samples go into each of our pixels
+    int samples_per_pixel(int sample_rate) const { 
+        return std::max((int)(sample_rate / m_pix_per_s), 1); 
+    }
     
     // number of pixels in a block (for a single channel)
     int get_num_pix_per_channel() const { 
+        if (is_compressed())
+            return m_channel_runs->empty() ? 0 : m_channel_runs->front().size();
         return m_channel_pixels->empty() ? 0 : m_channel_pixels->front().size(); 
     }
 
     // fill a json object with a block
     void to_json(json& j) const {
-        j = *m_channel_pixels;
+        j = is_compressed() ? *expand().m_channel_pixels : *m_channel_pixels;
     }
 
-    // wrapper to apply transformations from transform object
-    void transform() {
-        m_transform->normalize(m_channel_pixels);
+    // the peaks of every channel, which transform() normalizes by
+    vec<channel_scale_t> measure() const {
+        if (is_compressed())
+            return expand().measure();
+        return audio_pixel_transform_t::measure(*m_channel_pixels);
     }
 
+    // normalizes every channel by its scale (see measure). 
+    // works in place, so only do this to blocks nobody else shares
+    void transform(const vec<channel_scale_t>& scales) {
+        if (is_compressed())
+            *this = expand();
+        m_transform->apply(*m_channel_pixels, scales);
+    }
+
+    // run-length encodes the pixels, so runs of identical pixels (silence, 
+    // mostly) are only stored once. compressed blocks are read through
+    // views, clone() and resampling, which expand them as needed.
+    // does nothing if it wouldn't save any memory
+    void compress() {
+        if (is_compressed())
+            return;
+
+        auto runs = std::make_shared<vec<pixel_run_channel_t>>();
+        size_t compressed_bytes = 0;
+        for (const vec<audio_pixel_t>& channel : *m_channel_pixels) {
+            runs->push_back(pixel_run_channel_t::encode(channel));
+            compressed_bytes += runs->back().size_bytes();
+        }
+
+        size_t dense_bytes = size_bytes();
+        debug("audio pixel block: compressing {} pps block from {} to {} bytes", 
+                m_pix_per_s, dense_bytes, compressed_bytes);
+        if (compressed_bytes >= dense_bytes)
+            return;
+
+        m_channel_runs = runs;
+        m_channel_pixels = std::make_shared<vec<vec<audio_pixel_t>>>();
+    }
 
-    // given a buffer with samples, update the block
-    // sample buffer must be interleaved
-    void update(vec<double>& sample_buffer, int num_channels, int sample_rate){
+    // an uncompressed copy of a compressed block
+    audio_pixel_block_t expand() const {
+        if (!is_compressed())
+            return clone();
+
+        audio_pixel_block_t block(m_pix_per_s);
+        block.m_transform = m_transform;
+        for (const pixel_run_channel_t& channel : *m_channel_runs)
+            block.m_channel_pixels->push_back(channel.expand());
+        return block;
+    }
+
+    bool is_compressed() const { return m_channel_runs != nullptr; }
+
+    // how much memory the pixels take up
+    size_t size_bytes() const {
+        size_t bytes = 0;
+        if (is_compressed()) {
+            for (const pixel_run_channel_t& channel : *m_channel_runs)
+                bytes += channel.size_bytes();
+        } else {
+            for (const vec<audio_pixel_t>& channel : *m_channel_pixels)
+                bytes += channel.size() * sizeof(audio_pixel_t);
+        }
+        return bytes;
+    }
+
+
+    // replace the block's pixels (one vector per channel)
+    void update(vec<vec<audio_pixel_t>> channel_pixels) {
+        m_channel_runs = nullptr;
+        *m_channel_pixels = std::move(channel_pixels);
+    }
+
+    // grows the block to cover t0 to t1, and reduces the pixels from 
+    // first_pix on again from the segments, which have to cover everything 
+    // from the start of first_pix (see update). the pixels before first_pix
+    // are kept, so appending to a growing track costs O(new samples)
+    void extend(const vec<sample_segment_t>& segments, int num_channels, int sample_rate,
+                double t0, double t1, int first_pix) {
+        int samples_per_pixel = this->samples_per_pixel(sample_rate);
+        long long num_samples_per_channel = (long long)((t1 - t0) * sample_rate);
+        int pixels_per_channel = ceil((double)num_samples_per_channel / samples_per_pixel) + 1;
+        first_pix = std::clamp(first_pix, 0, pixels_per_channel);
+
+        grow(num_channels, pixels_per_channel);
+        for (int channel = 0; channel < num_channels; channel++) {
+            vec<audio_pixel_t>& pixels = m_channel_pixels->at(channel);
+            std::fill(pixels.begin() + first_pix, pixels.end(), audio_pixel_t(0, 0, 0));
+            reduce_slice(segments, num_channels, channel, sample_rate, t0,
+                         samples_per_pixel, first_pix, pixels_per_channel);
+        }
+    }
+
+    // given segments of samples, update the block. 
+    // samples must be interleaved. the block covers t0 to t1 (in project 
+    // time), and anything that isn't covered by a segment is silence.
+    // if a pool is given, each channel is split into pixel aligned time 
+    // slices that get reduced in parallel (the calling thread does one too).
+    // don't pass the pool if we're running on its only thread
+    void update(const vec<sample_segment_t>& segments, int num_channels, int sample_rate,
+                double t0, double t1, ThreadPool* pool = nullptr){
         debug("updating audio pixel block with pps {}", m_pix_per_s);
 
         //calcualte the samples per audio pixel and initalize an audio pixel
-        int samples_per_pixel = sample_rate / m_pix_per_s;
-        int num_samples_per_channel = sample_buffer.size() / num_channels;
-        int pixels_per_channel = ceil((float)num_samples_per_channel / (float)samples_per_pixel) + 1;
+        int samples_per_pixel = this->samples_per_pixel(sample_rate);
+        long long num_samples_per_channel = (long long)((t1 - t0) * sample_rate);
+        int pixels_per_channel = ceil((double)num_samples_per_channel / samples_per_pixel) + 1;
+
+        // gaps start out (and stay) as silence
+        m_channel_runs = nullptr;
+        m_channel_pixels->assign(num_channels, 
+                                 vec<audio_pixel_t>(pixels_per_channel, audio_pixel_t(0, 0, 0)));
+
+        // slices never share a pixel, so each one owns its part of the 
+        // output, and the sums of squares never have to be combined across
+        // slices. stitching them back together is free.
+        long long samples_read = 0;
+        for (const sample_segment_t& segment : segments)
+            samples_read += segment.samples.size() / std::max(num_channels, 1);
+
+        int num_slices = 1;
+        if (pool) {
+            int max_slices = std::clamp((int)std::thread::hardware_concurrency(), 1, 16);
+            num_slices = std::clamp((int)(samples_read / MIN_SLICE_SAMPLES), 1, max_slices);
+        }
+        int slice_pix = (pixels_per_channel + num_slices - 1) / num_slices;
+
+        vec<std::function<void()>> slices;
+        for (int channel = 0; channel < num_channels; channel++) {
+            for (int first_pix = 0; first_pix < pixels_per_channel; first_pix += slice_pix) {
+                int last_pix = std::min(first_pix + slice_pix, pixels_per_channel);
+                slices.push_back([=, &segments, this]() {
+                    reduce_slice(segments, num_channels, channel, sample_rate, t0,
+                                 samples_per_pixel, first_pix, last_pix);
+                });
+            }
+        }
+
+        if (slices.size() > 1)
+            debug("audio pixel block: reducing {} slices of {} pixels", slices.size(), slice_pix);
+
+        vec<std::future<void>> pending;
+        if (pool && slices.size() > 1) {
+            for (size_t i = 1; i < slices.size(); i++)
+                pending.push_back(pool->enqueue(slices[i]));
+            slices.resize(1);
+        }
+        for (auto& slice : slices)
+            slice();
+        for (auto& future : pending)
+            future.get();
+
+        debug("DONE updating audio pixel block with pps {}", m_pix_per_s);
+    }
+
+private: 
+    // resizes every channel to num_pix (new pixels are silent), expanding
+    // the block first if it's compressed. capacity at least doubles when
+    // it runs out, so growing a bit at a time is amortized O(1) per pixel
+    void grow(int num_channels, int num_pix) {
+        if (is_compressed())
+            *this = expand();
 
-        // reallocate if we need to
         m_channel_pixels->resize(num_channels);
-        for (auto& chan: *m_channel_pixels) {
-            chan.resize(pixels_per_channel);
+        for (vec<audio_pixel_t>& pixels : *m_channel_pixels) {
+            if (pixels.capacity() < num_pix)
+                pixels.reserve(std::max((size_t)num_pix, pixels.capacity() * 2));
+            pixels.resize(num_pix, audio_pixel_t(0, 0, 0));
         }
+    }
 
-        
-        for (int channel = 0; channel < num_channels; channel++) {
-            std::fill(m_channel_pixels->at(channel).begin(), 
-                    m_channel_pixels->at(channel).end(), 
-                    audio_pixel_t());     
-            // debug("processing channel {}", channel);
-            int pixel_idx = 0;
-            for (int i = 0; i < num_samples_per_channel; i++) {
-                // debug("processing sample {} ", i);
-                double curr_sample = sample_buffer.at(i*num_channels + channel);
-
-                if (pixel_idx >= (*m_channel_pixels).at(channel).size()) {
-                    info("a fatal error occurred. pixel_idx {} is out of bounds", pixel_idx);
-                    assert(false);
+    // fills dst from first on, where each pixel merges factor pixels of src
+    // (see merge_down). src is a dense_channel_t or a pixel_run_channel_t
+    template<typename channel_t>
+    static void merge_pixels(const channel_t& src, int src_num_pix, int factor,
+                             vec<audio_pixel_t>& dst, int first) {
+        for (int i = first; i < dst.size(); i++) {
+            float max = std::numeric_limits<float>::lowest();
+            float min = std::numeric_limits<float>::max();
+            double sum_sq = 0.0;
+            double count = 0.0;
+            int first_src = i * factor;
+            int last_src = std::min((i + 1) * factor, src_num_pix);
+            src.reduce(first_src, last_src, max, min, sum_sq, count);
+
+            // the last pixel can run past the end of src. that part is
+            // silence, and counts fully, like reduce_slice pads its last pixel
+            int missing = factor - (last_src - first_src);
+            if (missing > 0 && last_src > first_src) {
+                max = std::max(max, 0.0f);
+                min = std::min(min, 0.0f);
+                count += count / (last_src - first_src) * missing;
+            }
+
+            audio_pixel_t& pixel = dst[i];
+            pixel.m_max = max;
+            pixel.m_min = min;
+            pixel.m_sum_sq = (float)sum_sq;
+            pixel.m_count = (uint32_t)count;
+        }
+    }
+
+    // reduces the samples of one channel that land in pixels 
+    // [first_pix, last_pix) (see update). only touches those pixels
+    void reduce_slice(const vec<sample_segment_t>& segments, int num_channels, int channel,
+                      int sample_rate, double t0, int samples_per_pixel,
+                      int first_pix, int last_pix) {
+        vec<audio_pixel_t>& pixels = m_channel_pixels->at(channel);
+
+        // how many samples landed in each pixel, and their sum of squares
+        int num_pix = last_pix - first_pix;
+        vec<long long> counts(num_pix);
+        vec<double> energy(num_pix);
+
+        for (const sample_segment_t& segment : segments) {
+            // where the segment starts, in samples from t0
+            long long offset = llround((segment.t_start - t0) * sample_rate);
+            long long seg_samples = segment.samples.size() / num_channels;
+            const float* src = segment.samples.data() + channel;
+
+            // the pixels of our slice this segment lands in
+            long long seg_first = std::max(std::max(offset, 0ll) / samples_per_pixel, 
+                                           (long long)first_pix);
+            long long seg_last = std::min((offset + seg_samples - 1) / samples_per_pixel, 
+                                          (long long)last_pix - 1);
+            for (long long pixel_idx = seg_first; pixel_idx <= seg_last; pixel_idx++) {
+                // the part of the segment that falls in this pixel
+                long long lo = std::max(pixel_idx * samples_per_pixel - offset, 0ll);
+                long long hi = std::min((pixel_idx + 1) * samples_per_pixel - offset, seg_samples);
+                if (hi <= lo)
+                    continue;
+
+                // the hot loop: max/min in float, energy in double,
+                // since summing thousands of squares in float drifts
+                float max = std::numeric_limits<float>::lowest();
+                float min = std::numeric_limits<float>::max();
+                double sum_sq = 0.0;
+                for (long long i = lo; i < hi; i++) {
+                    float curr_sample = src[i * num_channels];
+                    max = std::max(max, curr_sample);
+                    min = std::min(min, curr_sample);
+                    sum_sq += (double)curr_sample * curr_sample;
                 }
-                audio_pixel_t& curr_pixel = (*m_channel_pixels).at(channel).at(pixel_idx); 
-        
-                // update all fields of the current pixeld based on the current sample
-                curr_pixel.m_max = std::max(curr_pixel.m_max, curr_sample);
-                curr_pixel.m_min = std::min(curr_pixel.m_min, curr_sample);
-                curr_pixel.m_rms += (curr_sample * curr_sample);
-
-                int collected_samples = i % samples_per_pixel;
-                if ((collected_samples == 0) || i == sample_buffer.size() - 1) {
-                    // debug("pixel {} collected", pixel_idx);
-                    // complete the RMS calculation, this method accounts 
-                    // of edge cases (total sample % samples per pixel != 0)
-                    curr_pixel.m_rms = sqrt(curr_pixel.m_rms / 
-                                            (samples_per_pixel - collected_samples));
-                    pixel_idx++;
+
+                audio_pixel_t& curr_pixel = pixels[pixel_idx];
+                long long slot = pixel_idx - first_pix;
+                if (counts[slot] == 0) {
+                    curr_pixel.m_max = max;
+                    curr_pixel.m_min = min;
+                } else {
+                    curr_pixel.m_max = std::max(curr_pixel.m_max, max);
+                    curr_pixel.m_min = std::min(curr_pixel.m_min, min);
                 }
+                energy[slot] += sum_sq;
+                counts[slot] += hi - lo;
             }
         }
-        debug("DONE updating audio pixel block with pps {}", m_pix_per_s);
+
+        // finish the pixels. the parts of a pixel that no segment 
+        // covered are silence: they count towards the rms window,
+        // and pull max/min towards zero
+        for (int slot = 0; slot < num_pix; slot++) {
+            audio_pixel_t& curr_pixel = pixels[first_pix + slot];
+            if (counts[slot] < samples_per_pixel) {
+                curr_pixel.m_max = std::max(curr_pixel.m_max, 0.0f);
+                curr_pixel.m_min = std::min(curr_pixel.m_min, 0.0f);
+            }
+            curr_pixel.m_sum_sq = (float)energy[slot];
+            curr_pixel.m_count = samples_per_pixel;
+        }
+    }
+
+    // merges the pixels of one channel that overlap each new pixel 
+    // (see aggregate). src is a dense_channel_t or a pixel_run_channel_t
+    template<typename channel_t>
+    static vec<audio_pixel_t> aggregate_channel(const channel_t& src, int src_num_pix,
+                                                double ratio, int new_num_pix) {
+        vec<audio_pixel_t> curr_pix_channel(new_num_pix);
+        for (int i = 0; i < new_num_pix; i++) {
+            // the (fractional) range of our pixels that this one covers
+            double lo = i * ratio;
+            double hi = std::min((i + 1) * ratio, (double)src_num_pix);
+            int first = std::min((int)floor(lo), src_num_pix - 1);
+            int last = std::clamp((int)ceil(hi), first + 1, src_num_pix);
+
+            float max = std::numeric_limits<float>::lowest();
+            float min = std::numeric_limits<float>::max();
+            double sum_sq = 0.0;
+            double count = 0.0;
+            src.reduce(first, last, max, min, sum_sq, count);
+
+            // take out the parts of the edge pixels that fall outside of our range
+            audio_pixel_t pix_first = src.at(first);
+            audio_pixel_t pix_last = src.at(last - 1);
+            sum_sq -= pix_first.m_sum_sq * (lo - first) + pix_last.m_sum_sq * (last - hi);
+            count -= pix_first.m_count * (lo - first) + pix_last.m_count * (last - hi);
+
+            float rms = count > 0 ? sqrt(std::max(sum_sq, 0.0) / count) : 0.0f;
+            curr_pix_channel[i] = audio_pixel_t(max, min, rms, std::max(1l, lround(count)));
+        }
+        return curr_pix_channel;
     }
 
-private: 
     // vector of audio_pixels for each channel 
+    // (empty when the block is compressed)
     shared_ptr<vec<vec<audio_pixel_t>>> m_channel_pixels {
         std::make_shared<vec<vec<audio_pixel_t>>>()
     }; 
 
+    // the run-length encoded pixels for each channel, if compressed
+    shared_ptr<const vec<pixel_run_channel_t>> m_channel_runs {nullptr};
+
     // pixels per second
     double m_pix_per_s {1.0};
     shared_ptr<audio_pixel_transform_t> m_transform {
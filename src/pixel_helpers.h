@@ -17,7 +17,7 @@ int pps_to_samples_per_pix(double pix_per_s, int sample_rate) {
 }
 
 double samples_per_pix_to_pps(int samples_per_pix, int sample_rate) {
-    return sample_rate / samples_per_pix;
+    return (double)sample_rate / samples_per_pix;
 }
 
 double linear_interp(double x, double x1, double x2, double y1, double y2) {
@@ -40,3 +40,10 @@ const vec<T> get_view(const vec<T>& parent, int start, int end)
     vec<T> vec(startptr, endptr);
     return vec;
 }
+
+// a run of interleaved samples, starting at t_start (in project time).
+// anything between two segments is silence
+struct sample_segment_t {
+    double t_start { 0.0 };
+    vec<float> samples;
+};
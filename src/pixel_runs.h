@@ -0,0 +1,229 @@
+#pragma once
+
+#include "pixel.h"
+
+#include <algorithm>
+#include <memory>
+
+// repeats shorter than this (in pixels) are stored as literals,
+// since a run costs more than a handful of pixels
+int MIN_PIXEL_RUN = 16;
+
+// literals are stored in chunks of this many pixels, and literal runs never
+// cross a chunk, so a channel can take a new tail by copying only its
+// last chunk (see with_tail)
+constexpr int LITERAL_CHUNK_PIXELS = 4096;
+
+// a run of pixels in a run-length encoded channel. either length copies
+// of the same pixel (a repeat), or length different pixels stored back
+// to back in the channel's literals, starting at literal
+// (chunk * LITERAL_CHUNK_PIXELS + offset)
+struct pixel_run_t {
+    int start {0};
+    int length {0};
+    int literal {-1}; // -1 for repeats
+    audio_pixel_t pixel;
+
+    int end() const { return start + length; }
+    bool repeat() const { return literal < 0; }
+};
+
+// one channel of pixels, where runs of identical pixels (mostly silence)
+// are stored once. slices share the literals with the channel they came
+// from, so slicing costs O(runs), not O(pixels).
+// never modified once encoded, so it's safe to read from any thread
+class pixel_run_channel_t {
+public:
+    pixel_run_channel_t() {};
+
+    static pixel_run_channel_t encode(const vec<audio_pixel_t>& pixels) {
+        pixel_run_channel_t channel;
+        channel.push(pixels.data(), pixels.size());
+        return channel;
+    }
+
+    // a copy of the channel with the pixels from first on replaced by
+    // num_pix pixels from src. the literals before first are shared, so
+    // this costs O(runs + num_pix + one chunk), not O(pixels)
+    pixel_run_channel_t with_tail(int first, const audio_pixel_t* src, int num_pix) const {
+        pixel_run_channel_t out;
+        first = std::clamp(first, 0, m_size);
+        if (first > 0) {
+            auto last = m_runs.begin() + (&run_at(first - 1) - m_runs.data());
+            out.m_runs.assign(m_runs.begin(), last + 1);
+            out.m_runs.back().length = first - out.m_runs.back().start;
+        }
+        out.m_size = first;
+
+        // the literals after the last kept literal run are dropped, and the
+        // chunk it ends in is copied, since we're about to add to it
+        for (auto it = out.m_runs.rbegin(); it != out.m_runs.rend(); it++) {
+            if (!it->repeat()) {
+                out.m_num_literals = it->literal + it->length;
+                break;
+            }
+        }
+        int num_chunks = (out.m_num_literals + LITERAL_CHUNK_PIXELS - 1) / LITERAL_CHUNK_PIXELS;
+        out.m_chunks.assign(m_chunks.begin(), m_chunks.begin() + num_chunks);
+        if (int used = out.m_num_literals % LITERAL_CHUNK_PIXELS) {
+            const vec<audio_pixel_t>& chunk = *out.m_chunks.back();
+            out.m_chunks.back() = std::make_shared<vec<audio_pixel_t>>(chunk.begin(), chunk.begin() + used);
+        }
+
+        out.push(src, num_pix);
+        return out;
+    }
+
+    // number of pixels in the channel
+    int size() const { return m_size; }
+
+    // how much memory the channel holds on to (not counting shared literals twice)
+    size_t size_bytes() const {
+        size_t bytes = m_runs.size() * sizeof(pixel_run_t);
+        for (const auto& chunk : m_chunks)
+            bytes += chunk->size() * sizeof(audio_pixel_t);
+        return bytes;
+    }
+
+    const vec<pixel_run_t>& runs() const { return m_runs; }
+
+    // the first literal pixel of a run (only for literal runs)
+    const audio_pixel_t* literals(const pixel_run_t& run) const {
+        return m_chunks[run.literal / LITERAL_CHUNK_PIXELS]->data()
+             + run.literal % LITERAL_CHUNK_PIXELS;
+    }
+
+    // the run containing pixel idx (idx must be in range)
+    const pixel_run_t& run_at(int idx) const {
+        auto it = std::upper_bound(m_runs.begin(), m_runs.end(), idx,
+                    [](int i, const pixel_run_t& run) { return i < run.start; });
+        return *(it - 1);
+    }
+
+    audio_pixel_t at(int idx) const {
+        const pixel_run_t& run = run_at(idx);
+        return run.repeat() ? run.pixel : literals(run)[idx - run.start];
+    }
+
+    // the pixels in [start, end), indexed from 0
+    pixel_run_channel_t slice(int start, int end) const {
+        pixel_run_channel_t out;
+        start = std::clamp(start, 0, m_size);
+        end = std::clamp(end, start, m_size);
+        out.m_size = end - start;
+        out.m_chunks = m_chunks;
+        out.m_num_literals = m_num_literals;
+        if (out.m_size == 0)
+            return out;
+
+        auto it = m_runs.begin() + (&run_at(start) - m_runs.data());
+        for (; it != m_runs.end() && it->start < end; it++) {
+            pixel_run_t run = *it;
+            int first = std::max(run.start, start);
+            int last = std::min(run.end(), end);
+            if (!run.repeat())
+                run.literal += first - run.start;
+            run.start = first - start;
+            run.length = last - first;
+            out.m_runs.push_back(run);
+        }
+        return out;
+    }
+
+    // max, min, sum of squares and sample count of the pixels in [first, last)
+    // repeats cost O(1), no matter how long they are
+    void reduce(int first, int last, float& max, float& min, 
+                double& sum_sq, double& count) const {
+        if (last <= first)
+            return;
+
+        auto it = m_runs.begin() + (&run_at(first) - m_runs.data());
+        for (; it != m_runs.end() && it->start < last; it++) {
+            int lo = std::max(it->start, first);
+            int hi = std::min(it->end(), last);
+            if (it->repeat()) {
+                max = std::max(max, it->pixel.m_max);
+                min = std::min(min, it->pixel.m_min);
+                sum_sq += (double)it->pixel.m_sum_sq * (hi - lo);
+                count += (double)it->pixel.m_count * (hi - lo);
+            } else {
+                const audio_pixel_t* src = literals(*it) + (lo - it->start);
+                for (int j = 0; j < hi - lo; j++) {
+                    max = std::max(max, src[j].m_max);
+                    min = std::min(min, src[j].m_min);
+                    sum_sq += src[j].m_sum_sq;
+                    count += src[j].m_count;
+                }
+            }
+        }
+    }
+
+    // back to plain pixels
+    vec<audio_pixel_t> expand() const {
+        vec<audio_pixel_t> pixels;
+        pixels.reserve(m_size);
+        for (const pixel_run_t& run : m_runs) {
+            if (run.repeat())
+                pixels.insert(pixels.end(), run.length, run.pixel);
+            else
+                pixels.insert(pixels.end(), literals(run), literals(run) + run.length);
+        }
+        return pixels;
+    }
+
+private:
+    // adds num_pix pixels at the end. long enough repeats become runs,
+    // the rest goes into the literals
+    void push(const audio_pixel_t* pixels, int num_pix) {
+        int base = m_size;
+        int literal_start = 0;
+        int i = 0;
+        while (i < num_pix) {
+            int j = i + 1;
+            while (j < num_pix && pixels[j] == pixels[i])
+                j++;
+
+            if (j - i >= MIN_PIXEL_RUN) {
+                push_literals(pixels + literal_start, base + literal_start, i - literal_start);
+                m_runs.push_back({base + i, j - i, -1, pixels[i]});
+                literal_start = j;
+            }
+            i = j;
+        }
+        push_literals(pixels + literal_start, base + literal_start, num_pix - literal_start);
+        m_size = base + num_pix;
+    }
+
+    // stores num_pix literal pixels for the pixels from start on. the last
+    // chunk must be ours alone (see with_tail), since it gets added to
+    void push_literals(const audio_pixel_t* pixels, int start, int num_pix) {
+        while (num_pix > 0) {
+            int offset = m_num_literals % LITERAL_CHUNK_PIXELS;
+            if (offset == 0)
+                m_chunks.push_back(std::make_shared<vec<audio_pixel_t>>());
+            int count = std::min(num_pix, LITERAL_CHUNK_PIXELS - offset);
+            m_chunks.back()->insert(m_chunks.back()->end(), pixels, pixels + count);
+
+            // carry on the last run if it's the literal run right before us
+            // (in the same chunk), so appends don't leave lots of tiny runs
+            pixel_run_t* last = m_runs.empty() ? nullptr : &m_runs.back();
+            if (offset > 0 && last && !last->repeat() && last->end() == start
+                && last->literal + last->length == m_num_literals)
+                last->length += count;
+            else
+                m_runs.push_back({start, count, m_num_literals, audio_pixel_t()});
+
+            m_num_literals += count;
+            pixels += count;
+            start += count;
+            num_pix -= count;
+        }
+    }
+
+    vec<pixel_run_t> m_runs;
+    // only the encoder (or with_tail) ever adds to a chunk, and only
+    // before the channel is handed out
+    vec<std::shared_ptr<vec<audio_pixel_t>>> m_chunks;
+    int m_num_literals {0};
+    int m_size {0};
+};
@@ -0,0 +1,116 @@
+#pragma once
+
+#include "reaper_plugin_functions.h"
+#include "log.h"
+
+#include <atomic>
+#include <map>
+#include <memory>
+
+// the bits of REAPER's state that the hot paths need.
+// never modified once published, so it's safe to hold on to
+// and read from any thread
+struct project_state_t {
+    int sample_rate {44100};
+    double hzoom {100.0};       // arrange view zoom, in pixels per second
+    double cursor {0.0};        // edit cursor, in seconds
+    int play_state {0};         // like GetPlayState: &1 playing, &2 paused, &4 recording
+    double play_position {0.0}; // in seconds
+
+    // channel count of every track in the project (and the master).
+    // only changes when the tracks do, so snapshots share it
+    // (see project_state_cache_t::refresh_tracks)
+    std::shared_ptr<const std::map<const MediaTrack*, int>> track_channels {
+        std::make_shared<const std::map<const MediaTrack*, int>>()
+    };
+
+    // a track's channel count, or 0 if we haven't seen the track
+    int num_channels(const MediaTrack* track) const {
+        auto it = track_channels->find(track);
+        return it == track_channels->end() ? 0 : it->second;
+    }
+
+    bool playing() const { return play_state & 1; }
+    bool recording() const { return play_state & 4; }
+};
+
+// keeps a project_state_t up to date, so worker threads (and per request
+// work) don't have to call into REAPER. the main thread refreshes the
+// transport every Run tick, and the tracks when they come or go (or one
+// at a time, see refresh_track), and everyone else reads immutable snapshots.
+// refresh from the main thread only, get from anywhere
+class project_state_cache_t {
+public:
+    // re-read the transport, cursor and zoom from REAPER and publish a new
+    // snapshot. costs the same no matter how big the session is
+    void refresh() {
+        auto state = std::make_shared<project_state_t>(*get());
+
+        // we always work at the project sample rate. only force it on if
+        // it's off, since setting it every time isn't free
+        if (GetSetProjectInfo(0, "PROJECT_SRATE_USE", 0, false) == 0)
+            GetSetProjectInfo(0, "PROJECT_SRATE_USE", 1, true);
+        state->sample_rate = (int)GetSetProjectInfo(0, "PROJECT_SRATE", 0, false);
+
+        state->hzoom = GetHZoomLevel();
+        state->cursor = GetCursorPosition();
+        state->play_state = GetPlayState();
+        state->play_position = GetPlayPosition();
+        std::atomic_store(&m_state, std::shared_ptr<const project_state_t>(state));
+    }
+
+    // re-read every track's channel count. for when tracks come or go
+    void refresh_tracks() {
+        auto channels = std::make_shared<std::map<const MediaTrack*, int>>();
+        int num_tracks = CountTracks(0);
+        for (int i = 0; i < num_tracks; i++) {
+            MediaTrack* track = GetTrack(0, i);
+            (*channels)[track] = (int)GetMediaTrackInfo_Value(track, "I_NCHAN");
+        }
+        MediaTrack* master = GetMasterTrack(0);
+        (*channels)[master] = (int)GetMediaTrackInfo_Value(master, "I_NCHAN");
+
+        auto state = std::make_shared<project_state_t>(*get());
+        state->track_channels = channels;
+        std::atomic_store(&m_state, std::shared_ptr<const project_state_t>(state));
+    }
+
+    // re-read one track's channel count (nothing gets published unless it
+    // changed). nothing tells us when that happens, so the staleness round
+    // robin calls this for each track it visits
+    void refresh_track(MediaTrack* track) {
+        int num_channels = (int)GetMediaTrackInfo_Value(track, "I_NCHAN");
+        auto current = get();
+        if (current->num_channels(track) == num_channels)
+            return;
+
+        auto channels = std::make_shared<std::map<const MediaTrack*, int>>(*current->track_channels);
+        (*channels)[track] = num_channels;
+        auto state = std::make_shared<project_state_t>(*current);
+        state->track_channels = channels;
+        std::atomic_store(&m_state, std::shared_ptr<const project_state_t>(state));
+    }
+
+    // the play state changed (from IReaperControlSurface::SetPlayState),
+    // publish it right away instead of waiting for the next tick
+    void set_play_state(bool play, bool pause, bool rec) {
+        auto state = std::make_shared<project_state_t>(*get());
+        state->play_state = (play ? 1 : 0) | (pause ? 2 : 0) | (rec ? 4 : 0);
+        std::atomic_store(&m_state, std::shared_ptr<const project_state_t>(state));
+    }
+
+    std::shared_ptr<const project_state_t> get() const {
+        return std::atomic_load(&m_state);
+    }
+
+private:
+    std::shared_ptr<const project_state_t> m_state {
+        std::make_shared<const project_state_t>()
+    };
+};
+
+// the process-wide project state
+project_state_cache_t& project_state() {
+    static project_state_cache_t cache;
+    return cache;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "log.h"
+
+#include <chrono>
+#include <mutex>
+
+// how long the audio has to stay still before we rebuild (ms)
+// typing in REAPER fires lots of edits in a row, we only want one rebuild
+int REBUILD_DEBOUNCE = 250;
+
+enum class rebuild_state_t {
+    idle,           // nothing to do
+    pending,        // something changed, waiting for the edits to settle
+    building,       // a rebuild is running
+    building_dirty  // a rebuild is running, and something changed since it started
+};
+
+// decides when a mipmap rebuild should run.
+// changes that land while a rebuild is running mark it dirty, and exactly
+// one follow up rebuild runs after it. requests are debounced, so a burst
+// of changes turns into a single rebuild once things settle.
+// thread safe
+class rebuild_scheduler_t {
+public:
+    using clock = std::chrono::steady_clock;
+
+    // something changed. every call pushes the debounce back, so call it
+    // once per change, not on every tick that something is still changed.
+    // immediate skips the debounce
+    void request(bool immediate = false) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_last_request = clock::now();
+        m_immediate |= immediate;
+
+        switch (m_state) {
+            case rebuild_state_t::idle:
+                m_state = rebuild_state_t::pending;
+                break;
+            case rebuild_state_t::building:
+                m_state = rebuild_state_t::building_dirty;
+                break;
+            default:
+                break;
+        }
+    }
+
+    // returns true if a rebuild should start now, in which case
+    // the caller must start one, and call finish() when it's done
+    bool try_start() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_state != rebuild_state_t::pending)
+            return false;
+
+        auto debounce = std::chrono::milliseconds(REBUILD_DEBOUNCE);
+        if (!m_immediate && clock::now() - m_last_request < debounce)
+            return false;
+
+        m_state = rebuild_state_t::building;
+        m_immediate = false;
+        return true;
+    }
+
+    // the rebuild is done. if anything changed while it was running,
+    // we go back to pending so the follow up rebuild gets picked up
+    void finish() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_state == rebuild_state_t::building_dirty) {
+            debug("scheduler: changes landed during the rebuild, scheduling another one");
+            m_state = rebuild_state_t::pending;
+        } else {
+            m_state = rebuild_state_t::idle;
+        }
+    }
+
+    rebuild_state_t state() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_state;
+    }
+
+private:
+    std::mutex m_mutex;
+    rebuild_state_t m_state {rebuild_state_t::idle};
+    clock::time_point m_last_request {};
+    bool m_immediate {false};
+};
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "include/oscpkt/oscpkt.hh"
+
+#include "client.h"
+#include "pixel.h"
+#include "metrics.h"
+
+#include <deque>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+// how many encoded views we hold on to
+int MAX_CACHED_VIEWS = 32;
+
+// identifies a range of pixels as seen by a client.
+// two clients with the same view get the exact same packets
+struct view_key_t {
+    const void* track {nullptr};
+    uint64_t generation {0}; // mipmap generation the pixels came from
+    int channel {0};
+    double pix_per_s {0};
+    int start {0};
+    int end {0};
+    size_t chunk_size {0};
+    pixel_format_t format {pixel_format_t::json};
+    int viewport_width {0};
+
+    auto as_tuple() const {
+        return std::tie(track, generation, channel, pix_per_s, start, end, 
+                        chunk_size, format, viewport_width);
+    }
+    bool operator<(const view_key_t& other) const { return as_tuple() < other.as_tuple(); }
+};
+
+// caches encoded /pixels messages, so the encoding cost scales with the
+// number of distinct views, not with the number of clients
+// thread safe
+class encoded_view_cache_t {
+public:
+    using chunks_t = vec<oscpkt::Message>;
+    using encoder_t = std::function<chunks_t()>;
+
+    // returns the cached chunks for a view, or encodes them
+    shared_ptr<const chunks_t> get(const view_key_t& key, encoder_t encode) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto it = m_views.find(key);
+            if (it != m_views.end()) {
+                metrics().view_cache_hits.add();
+                return it->second;
+            }
+        }
+
+        // encode outside of the lock. if two clients race for the same
+        // view we encode it twice, which is fine
+        metrics().view_cache_misses.add();
+        auto chunks = std::make_shared<const chunks_t>(encode());
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_views.emplace(key, chunks).second)
+            m_order.push_back(key);
+
+        // evict the oldest views
+        while (m_order.size() > MAX_CACHED_VIEWS) {
+            m_views.erase(m_order.front());
+            m_order.pop_front();
+        }
+        return chunks;
+    }
+
+private:
+    std::mutex m_mutex;
+    std::map<view_key_t, shared_ptr<const chunks_t>> m_views;
+    std::deque<view_key_t> m_order; // insertion order, for eviction
+};